@@ -1,9 +1,18 @@
 #include "cairo.h"
 #include "animations.h"
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <time.h>
+#include <unistd.h>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 const int LUT[LUT_LEN] = {
   __,__,__, 0,__, 1,__, 2,__,__,__,
@@ -20,26 +29,137 @@ const int LUT[LUT_LEN] = {
   __,__,__,53,__,52,__,51,__,__,__
  };
 
-void add_frame_to_animation_context(AnimationContext *ctx, cairo_surface_t *surface) {
-    // Increment the frame count
-    ++(ctx->frame_count);
+uint32_t convert_argb_to_neopixel(uint32_t argb) {
+    uint8_t a = 1;
+    /* uint8_t a = (argb >> 24) & 0xFF; */
+    uint8_t r = (argb >> 16) & 0xFF;
+    uint8_t g = (argb >> 8) & 0xFF;
+    uint8_t b = argb & 0xFF;
+
+    return (a << 24) | (r << 16) | (g << 8) | b;
+}
+
+// The LUT compiled into (canvas offset, LED) pairs ordered by LED, so mapping
+// a canvas only touches the pixels that have an LED
+typedef struct {
+    uint16_t offset;
+    uint16_t led;
+} lut_gather_t;
+
+static lut_gather_t lut_gather[LUT_LEN];
+static int lut_gather_count = -1;
+
+static void build_lut_gather(void) {
+    int pixel_of_led[LUT_LEN];
+    int count = 0;
+
+    for (int led = 0; led < LUT_LEN; led++) {
+        pixel_of_led[led] = __;
+    }
+
+    // Later pixels win if two map to the same LED, as they did when scanning the canvas
+    for (int i = 0; i < LUT_LEN; i++) {
+        if (LUT[i] != __) {
+            pixel_of_led[LUT[i]] = i;
+        }
+    }
+
+    for (int led = 0; led < LUT_LEN; led++) {
+        if (pixel_of_led[led] != __) {
+            lut_gather[count].offset = pixel_of_led[led];
+            lut_gather[count].led = led;
+            count++;
+        }
+    }
+
+    lut_gather_count = count;
+}
+
+// Map a canvas to LED values, LEDs from count on are left out
+static void gather_canvas(const uint32_t *canvas, ws2811_led_t *leds, int count) {
+    if (lut_gather_count < 0) {
+        build_lut_gather();
+    }
+
+    for (int i = 0; i < lut_gather_count && lut_gather[i].led < count; i++) {
+        leds[lut_gather[i].led] = convert_argb_to_neopixel(canvas[lut_gather[i].offset]);
+    }
+}
 
-    // Resize the array of frames
-    ctx->frames = realloc(ctx->frames, ctx->frame_count * sizeof(cairo_surface_t*));
-    if (ctx->frames == NULL) {
+void reserve_animation_frames(AnimationContext *ctx, int frames) {
+    if (frames <= ctx->max_frames) {
+        return;
+    }
+
+    // Frames are addressed by index, so moving the slab is fine
+    ctx->pixels = realloc(ctx->pixels, (size_t)frames * animation_frame_size(ctx) * sizeof(uint32_t));
+    if (ctx->pixels == NULL) {
         // Handle memory allocation failure here
         exit(1);
     }
+    ctx->max_frames = frames;
+}
 
-    // Save the new surface pointer into the frames array
-    ctx->frames[ctx->frame_count - 1] = surface;
+static uint32_t *add_frame_to_animation_context(AnimationContext *ctx) {
+    // Grow by doubling when the caller didn't reserve enough
+    if (ctx->frame_count == ctx->max_frames) {
+        reserve_animation_frames(ctx, ctx->max_frames ? ctx->max_frames * 2 : 64);
+    }
+
+    uint32_t *frame = animation_frame(ctx, ctx->frame_count++);
+    memset(frame, 0, animation_frame_size(ctx) * sizeof(uint32_t));
+
+    return frame;
+}
+
+// Convert a canvas into a frame of the kind ctx stores
+static void canvas_to_frame(const AnimationContext *ctx, const uint32_t *canvas, uint32_t *frame) {
+    if (!ctx->led_count) {
+        memcpy(frame, canvas, LUT_LEN * sizeof(uint32_t));
+        return;
+    }
+
+    memset(frame, 0, ctx->led_count * sizeof(uint32_t));
+    gather_canvas(canvas, frame, ctx->led_count);
+}
+
+static void add_canvas_frame(AnimationContext *ctx, const uint32_t *canvas) {
+    canvas_to_frame(ctx, canvas, add_frame_to_animation_context(ctx));
+}
+
+// Wrap a canvas in a cairo surface, valid until end_frame().  Canvas frames
+// are drawn in place, LED frames in scratch and packed by end_frame().
+static cairo_t *begin_frame(AnimationContext *ctx, uint32_t *scratch, cairo_surface_t **surface) {
+    uint32_t *canvas = scratch;
+
+    if (ctx->led_count) {
+        memset(scratch, 0, LUT_LEN * sizeof(uint32_t));
+    } else {
+        canvas = add_frame_to_animation_context(ctx);
+    }
+
+    *surface = cairo_image_surface_create_for_data((unsigned char *)canvas, CAIRO_FORMAT_ARGB32,
+                                                   LUT_W, LUT_H, LUT_W * sizeof(uint32_t));
+    return cairo_create(*surface);
+}
+
+static void end_frame(AnimationContext *ctx, cairo_surface_t *surface, cairo_t *cr) {
+    cairo_destroy(cr);
+    cairo_surface_flush(surface);
+
+    if (ctx->led_count) {
+        add_canvas_frame(ctx, (const uint32_t *)cairo_image_surface_get_data(surface));
+    }
+
+    cairo_surface_destroy(surface);
 }
 
 void draw_rotating_pie_chart_frame(AnimationContext *ctx, double rotation_angle) {
     const int width  = LUT_W;
     const int height = LUT_H;
-    cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
-    cairo_t *cr = cairo_create(surface);
+    uint32_t canvas[LUT_LEN];
+    cairo_surface_t *surface;
+    cairo_t *cr = begin_frame(ctx, canvas, &surface);
 
     // Clear the background with black
     cairo_set_source_rgb(cr, 0, 0, 0);
@@ -80,18 +200,16 @@ void draw_rotating_pie_chart_frame(AnimationContext *ctx, double rotation_angle)
     cairo_arc(cr, 0, 0, 1 / width, 0, 2 * PI);  // Circle with 1-pixel radius
     cairo_fill(cr);
 
-    // Save the surface to the dynamic array of frames
-    add_frame_to_animation_context(ctx, surface);
-
-    // Clean up
-    cairo_destroy(cr);
+    // Clean up, the pixels stay in the frame slab
+    end_frame(ctx, surface, cr);
 }
 
 void draw_ellipse_frame(AnimationContext *ctx, double scale_factor) {
     const int width = LUT_W;
     const int height = LUT_H;
-    cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
-    cairo_t *cr = cairo_create(surface);
+    uint32_t canvas[LUT_LEN];
+    cairo_surface_t *surface;
+    cairo_t *cr = begin_frame(ctx, canvas, &surface);
 
     // Clear the background with black
     cairo_set_source_rgb(cr, 0, 0, 0);
@@ -110,95 +228,169 @@ void draw_ellipse_frame(AnimationContext *ctx, double scale_factor) {
     cairo_arc(cr, 0, 0, 1, 0, 2 * PI);
     cairo_fill(cr);
 
-    // Save the surface to the dynamic array of frames
-    add_frame_to_animation_context(ctx, surface);
+    // Clean up, the pixels stay in the frame slab
+    end_frame(ctx, surface, cr);
+}
 
-    // Clean up
-    cairo_destroy(cr);
+int lut_index(int x, int y, int width) {
+    // Assuming the LUT is filled row by row
+    return LUT[y * width + x];
 }
 
-uint32_t convert_argb_to_neopixel(uint32_t argb) {
-    uint8_t a = 1;
-    /* uint8_t a = (argb >> 24) & 0xFF; */
-    uint8_t r = (argb >> 16) & 0xFF;
-    uint8_t g = (argb >> 8) & 0xFF;
-    uint8_t b = argb & 0xFF;
+// Terminal preview of the LEDs, off unless enable_preview() is called.
+// shown is what the terminal displays, so only cells that changed are redrawn.
+#define PREVIEW_CELL_WIDTH 9
+#define PREVIEW_CELL_BYTES 48   // cursor move, colour and value of one cell
+
+static struct {
+    int enabled;
+    uint64_t interval_us;
+    uint64_t last_us;
+    int valid;
+    uint32_t shown[LUT_LEN];
+} preview;
+
+void enable_preview(int max_fps) {
+    preview.enabled = max_fps > 0;
+    preview.interval_us = preview.enabled ? 1000000 / max_fps : 0;
+    preview.valid = 0;
+}
 
-    return (a << 24) | (r << 16) | (g << 8) | b;
+static uint64_t preview_time_us(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
 }
 
-int lut_index(int x, int y, int width) {
-    // Assuming the LUT is filled row by row
-    return LUT[y * width + x];
+// Whether a preview should be drawn now, at most max_fps times a second
+static int preview_due(void) {
+    if (!preview.enabled) {
+        return 0;
+    }
+
+    uint64_t now = preview_time_us();
+    if (preview.valid && now - preview.last_us < preview.interval_us) {
+        return 0;
+    }
+    preview.last_us = now;
+
+    return 1;
 }
 
-void print_frame_as_table(int width, int height, cairo_surface_t *surface) {
-    unsigned char *data = cairo_image_surface_get_data(surface);
- // Move the cursor to the top-left corner of the terminal
-    printf("\033[H");
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            int offset = (y * width + x) * 4;
-            uint32_t argb = *(uint32_t *)(data + offset);
-            uint32_t neopixel_color = convert_argb_to_neopixel(argb);
-            int index = lut_index(x, y, width);
+// Show the LEDs as the LUT lays them out, works for both kinds of frames
+static void draw_preview(const ws2811_channel_t *channel) {
+    char buf[LUT_LEN * PREVIEW_CELL_BYTES + 64];
+    int len = 0;
+
+    if (!preview.valid) {
+        // Clear the screen, every cell is drawn below
+        len += snprintf(buf + len, sizeof(buf) - len, "\033[H\033[2J");
+    }
+
+    for (int y = 0; y < LUT_H; y++) {
+        for (int x = 0; x < LUT_W; x++) {
+            int index = lut_index(x, y, LUT_W);
+
+            if (index == __ || index >= channel->count) {
+                continue;
+            }
+
+            uint32_t neopixel_color = channel->leds[index];
+            if (preview.valid && preview.shown[y * LUT_W + x] == neopixel_color) {
+                continue;
+            }
+            preview.shown[y * LUT_W + x] = neopixel_color;
 
-            if (index != __) {
-               uint8_t r = (neopixel_color >> 16) & 0xFF;
-               uint8_t g = (neopixel_color >> 8) & 0xFF;
-               uint8_t b = neopixel_color & 0xFF;
+            uint8_t r = (neopixel_color >> 16) & 0xFF;
+            uint8_t g = (neopixel_color >> 8) & 0xFF;
+            uint8_t b = neopixel_color & 0xFF;
 
             // Scale down to fit into ANSI 6x6x6 cube
-               uint8_t scaled_r = r / 51;
-               uint8_t scaled_g = g / 51;
-               uint8_t scaled_b = b / 51;
-
-            // Convert to ANSI index
-               int ansi_index = 16 + (36 * scaled_r) + (6 * scaled_g) + scaled_b;
-
-                // Assuming hexadecimal output and 8 characters wide field
-                printf("\033[38;5;%dm%08X \033[0m", ansi_index, neopixel_color);
-            } else {
-                // Print 8 spaces to align
-                printf("        ");
+            int ansi_index = 16 + (36 * (r / 51)) + (6 * (g / 51)) + (b / 51);
+
+            // Every other line is left empty, as the LUT skips every other pixel
+            len += snprintf(buf + len, sizeof(buf) - len, "\033[%d;%dH\033[38;5;%dm%08X\033[0m",
+                            (y * 2) + 1, (x * PREVIEW_CELL_WIDTH) + 1, ansi_index, neopixel_color);
+        }
+    }
+
+    if (len) {
+        // Leave the cursor below the table
+        len += snprintf(buf + len, sizeof(buf) - len, "\033[%d;1H", (LUT_H * 2) + 1);
+
+        // A slow terminal can take part of it, the cells in shown must all be on screen
+        for (int done = 0; done < len; ) {
+            ssize_t written = write(STDOUT_FILENO, buf + done, len - done);
+
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                preview.valid = 0;
+                return;
             }
+            done += written;
         }
-        printf("\n");  // Newline after each row
-        printf("\n");  // Newline after each row
     }
+    preview.valid = 1;
+}
+
+void preview_leds(const ws2811_channel_t *channel) {
+    if (preview_due()) {
+        draw_preview(channel);
+    }
+}
+
+void preview_animation_frame(const AnimationContext *ctx, int index, ws2811_t *ledstring) {
+    if (!preview_due()) {
+        return;
+    }
+
+    // Frames sent from the cache leave an older frame in the LEDs
+    copy_animation_frame_to_leds(ctx, index, ledstring);
+    draw_preview(&ledstring->channel[0]);
 }
 
-void send_frame_to_neopixels(cairo_surface_t *surface, ws2811_t *ledstring) {
-    unsigned char *data = cairo_image_surface_get_data(surface);
-    int width  = cairo_image_surface_get_width(surface);
-    int height = cairo_image_surface_get_height(surface);
+void copy_frame_to_leds(const uint32_t *frame, ws2811_t *ledstring) {
+    // Only pixels with an LED are read
+    gather_canvas(frame, ledstring->channel[0].leds, ledstring->channel[0].count);
+}
 
-    print_frame_as_table(width,height,surface);
+ws2811_return_t send_frame_to_neopixels(const uint32_t *frame, ws2811_t *ledstring) {
+    copy_frame_to_leds(frame, ledstring);
+    preview_leds(&ledstring->channel[0]);
 
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            int offset = (y * width + x) * 4;  // 4 bytes per pixel for ARGB
-            uint32_t argb = *(uint32_t *)(data + offset);
-            uint32_t neopixel_color = convert_argb_to_neopixel(argb);
+    return ws2811_render(ledstring);
+}
 
-            // Assuming you have a function to convert 2D coordinates to a 1D index
-            int index = lut_index(x, y, width);
+void copy_animation_frame_to_leds(const AnimationContext *ctx, int index, ws2811_t *ledstring) {
+    ws2811_channel_t *channel = &ledstring->channel[0];
+    const uint32_t *frame = animation_frame(ctx, index);
 
-            // Send only when there is a pixel
-            if (index != __)
-            {
-                ledstring->channel[0].leds[index] = neopixel_color;
-            }
-        }
+    if (!ctx->led_count) {
+        copy_frame_to_leds(frame, ledstring);
+        return;
     }
 
-    ws2811_render(ledstring);
+    // Already in LED order and format
+    memcpy(channel->leds, frame,
+           (ctx->led_count < channel->count ? ctx->led_count : channel->count) * sizeof(ws2811_led_t));
+}
+
+ws2811_return_t send_animation_frame_to_neopixels(const AnimationContext *ctx, int index, ws2811_t *ledstring) {
+    copy_animation_frame_to_leds(ctx, index, ledstring);
+    preview_leds(&ledstring->channel[0]);
+
+    return ws2811_render(ledstring);
 }
 
 void make_rotating_frames(AnimationContext *ctx, int num_frames) {
     double max_angle = 1.5 * PI; // Maximum rotation angle
     double delta_angle = max_angle / (num_frames / 2); // Angle change per frame
 
+    reserve_animation_frames(ctx, ctx->frame_count + (num_frames / 2) * 2);
+
     // Rotate from 0 to max_angle
     for (int i = 0; i < num_frames / 2; i++) {
         double rotation_angle = i * delta_angle;
@@ -213,6 +405,8 @@ void make_rotating_frames(AnimationContext *ctx, int num_frames) {
 }
 
 void make_growing_ellipse(AnimationContext *ctx, int num_frames) {
+    reserve_animation_frames(ctx, ctx->frame_count + (num_frames / 2) * 2);
+
     // Grow ellipse from 0.1 to 1.0 scale
     for (int i = 0; i < num_frames / 2; i++) {
         double scale_factor = 0.1 + (0.9 * i) / (num_frames / 2);
@@ -226,78 +420,72 @@ void make_growing_ellipse(AnimationContext *ctx, int num_frames) {
     }
 }
 
+// Crossfade weights are 8.8 fixed point, 0 keeps the first frame, 256 gives the second
+#define BLEND_ONE 256
+
+// Blend every byte of count pixels: dst = (a * (256 - weight) + b * weight) >> 8.
+// Both products fit in 16 bits, so the vector versions work on 16 bit lanes.
+static void blend_pixels(uint32_t *dst, const uint32_t *a, const uint32_t *b, int count, int weight) {
+    const uint8_t *pa = (const uint8_t *)a;
+    const uint8_t *pb = (const uint8_t *)b;
+    uint8_t *pd = (uint8_t *)dst;
+    int bytes = count * 4;
+    int i = 0;
+
+#if defined(__ARM_NEON)
+    const uint16x8_t wa = vdupq_n_u16(BLEND_ONE - weight);
+    const uint16x8_t wb = vdupq_n_u16(weight);
+
+    for (; i + 16 <= bytes; i += 16) {
+        uint8x16_t va = vld1q_u8(pa + i);
+        uint8x16_t vb = vld1q_u8(pb + i);
+        uint16x8_t lo = vmlaq_u16(vmulq_u16(vmovl_u8(vget_low_u8(va)), wa), vmovl_u8(vget_low_u8(vb)), wb);
+        uint16x8_t hi = vmlaq_u16(vmulq_u16(vmovl_u8(vget_high_u8(va)), wa), vmovl_u8(vget_high_u8(vb)), wb);
+
+        vst1q_u8(pd + i, vcombine_u8(vshrn_n_u16(lo, 8), vshrn_n_u16(hi, 8)));
+    }
+#elif defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i wa = _mm_set1_epi16(BLEND_ONE - weight);
+    const __m128i wb = _mm_set1_epi16(weight);
+
+    for (; i + 16 <= bytes; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(pa + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(pb + i));
+        __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(va, zero), wa),
+                                   _mm_mullo_epi16(_mm_unpacklo_epi8(vb, zero), wb));
+        __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(va, zero), wa),
+                                   _mm_mullo_epi16(_mm_unpackhi_epi8(vb, zero), wb));
+
+        _mm_storeu_si128((__m128i *)(pd + i),
+                         _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8)));
+    }
+#endif
+
+    for (; i < bytes; i++) {
+        pd[i] = (pa[i] * (BLEND_ONE - weight) + pb[i] * weight) >> 8;
+    }
+}
+
 void smooth_interpolate_to_new_frames(
     AnimationContext *current_ctx,
     AnimationContext *new_ctx,
     AnimationContext *transition_ctx,
     int fps) {
 
- // Deallocate any dynamically allocated resources in transition_ctx
-
     // Get the current frame from the current context
-    cairo_surface_t *current_surface = current_ctx->frames[current_ctx->current_frame];
+    const uint32_t *current_frame = animation_frame(current_ctx, current_ctx->current_frame);
 
     // Get the current frame from the new context (current frame might not be first if animation changed)
-    cairo_surface_t *target_surface = new_ctx->frames[new_ctx->current_frame];
-
-    unsigned char *current_data = cairo_image_surface_get_data(current_surface);
-    unsigned char *target_data = cairo_image_surface_get_data(target_surface);
-
-    // Loop through each frame to perform the interpolation
-    for (int i = 1; i <= fps; i++) {
-        // Calculate the weight for interpolation
-        double weight = (double)i / fps;
-
-        // Create a new surface for the interpolated frame
-        cairo_surface_t *interpolated_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, LUT_W, LUT_H);
-        cairo_t *cr = cairo_create(interpolated_surface);
-
-        cairo_surface_flush(interpolated_surface);
-        unsigned char *interpolated_data = cairo_image_surface_get_data(interpolated_surface);
+    const uint32_t *target_frame = animation_frame(new_ctx, new_ctx->current_frame);
 
-        for (int y = 0; y < LUT_H; y++) {
-            for (int x = 0; x < LUT_W; x++) {
-                int offset = (y * LUT_W + x) * 4; // 4 bytes per pixel for ARGB
-
-                unsigned char *current_pixel = current_data + offset;
-                unsigned char *target_pixel = target_data + offset;
-
-                unsigned char current_a = current_pixel[3];
-                unsigned char current_r = current_pixel[2];
-                unsigned char current_g = current_pixel[1];
-                unsigned char current_b = current_pixel[0];
-
-                unsigned char target_a = target_pixel[3];
-                unsigned char target_r = target_pixel[2];
-                unsigned char target_g = target_pixel[1];
-                unsigned char target_b = target_pixel[0];
-
-                // Interpolate each channel individually
-                unsigned char interpolated_a = (unsigned char)(weight * target_a + (1 - weight) * current_a);
-                unsigned char interpolated_r = (unsigned char)(weight * target_r + (1 - weight) * current_r);
-                unsigned char interpolated_g = (unsigned char)(weight * target_g + (1 - weight) * current_g);
-                unsigned char interpolated_b = (unsigned char)(weight * target_b + (1 - weight) * current_b);
-
-                // Combine interpolated channels back into a single 32-bit ARGB color
-                uint32_t interpolated_color = (interpolated_a << 24) | (interpolated_r << 16) | (interpolated_g << 8) | interpolated_b;
-
-                // Set the interpolated color to the new cairo surface
-                *(uint32_t *)(interpolated_data + offset) = interpolated_color;
-            }
-        }
-
-
-        // Mark the surface as dirty as we have modified it at the pixel level
-        cairo_surface_mark_dirty(interpolated_surface);
-
-        // Save the interpolated frame
-        add_frame_to_animation_context(transition_ctx, interpolated_surface);
-        // Cleanup
-        cairo_destroy(cr);
-    }
+    // All three contexts must store the same kind of frames
+    smooth_interpolate_between_frames(current_frame, target_frame, transition_ctx, fps);
 }
 
 void make_color_spectrum(AnimationContext *ctx, int num_frames) {
+    reserve_animation_frames(ctx, ctx->frame_count + num_frames);
+
     for (int i = 0; i < num_frames; i++) {
         // Calculate the progress through the spectrum
         double progress = (double)i / num_frames;
@@ -314,9 +502,10 @@ void make_color_spectrum(AnimationContext *ctx, int num_frames) {
 }
 
 void draw_full_color_frame(AnimationContext *ctx, int r, int g, int b) {
-    // Create a new Cairo surface for the frame
-    cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, LUT_W, LUT_H);
-    cairo_t *cr = cairo_create(surface);
+    // Create a new Cairo surface over the next frame
+    uint32_t canvas[LUT_LEN];
+    cairo_surface_t *surface;
+    cairo_t *cr = begin_frame(ctx, canvas, &surface);
 
     // Set the color
     cairo_set_source_rgb(cr, r / 255.0, g / 255.0, b / 255.0);  // Cairo expects color components to be in [0, 1]
@@ -325,20 +514,12 @@ void draw_full_color_frame(AnimationContext *ctx, int r, int g, int b) {
     cairo_rectangle(cr, 0, 0, LUT_W, LUT_H);
     cairo_fill(cr);
 
-    // Add this frame to the animation context
-    add_frame_to_animation_context(ctx, surface);
-
-    // Clean up
-    cairo_destroy(cr);
+    // Clean up, the pixels stay in the frame slab
+    end_frame(ctx, surface, cr);
 }
 
-void draw_random_color_frame(AnimationContext *ctx) {
-    // Create a new surface
-    cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, LUT_W, LUT_H);
-    cairo_surface_flush(surface);
-    unsigned char *data = cairo_image_surface_get_data(surface);
-
-    // Loop over each pixel
+// Fill a frame with random colors, without adding it to a context
+static void create_random_color_frame(unsigned char *data) {
     for (int y = 0; y < LUT_H; y++) {
         for (int x = 0; x < LUT_W; x++) {
             // Generate random colors in the range [0, 255]
@@ -373,152 +554,74 @@ void draw_random_color_frame(AnimationContext *ctx) {
             data[offset + 3] = 255; // Alpha channel (fully opaque)
         }
     }
+}
 
-    // Mark the surface as dirty after manually changing pixels
-    cairo_surface_mark_dirty(surface);
-
-    // Add this frame to the context
-    add_frame_to_animation_context(ctx, surface);
+void draw_random_color_frame(AnimationContext *ctx) {
+    uint32_t canvas[LUT_LEN];
 
+    create_random_color_frame((unsigned char *)canvas);
+    add_canvas_frame(ctx, canvas);
 }
 
 void smooth_interpolate_between_frames(
-    cairo_surface_t *first_frame,
-    cairo_surface_t *second_frame,
+    const uint32_t *first_frame,
+    const uint32_t *second_frame,
     AnimationContext *ctx,
     int fps) {
 
-    // Get data for the first and second frames
-    unsigned char *first_data = cairo_image_surface_get_data(first_frame);
-    unsigned char *second_data = cairo_image_surface_get_data(second_frame);
+    // Copy the first and second frames, they may be in ctx and move when it grows
+    const int frame_size = animation_frame_size(ctx);
+    uint32_t first_copy[LUT_LEN];
+    uint32_t second_copy[LUT_LEN];
+    memcpy(first_copy, first_frame, frame_size * sizeof(uint32_t));
+    memcpy(second_copy, second_frame, frame_size * sizeof(uint32_t));
+
+    reserve_animation_frames(ctx, ctx->frame_count + fps);
 
     // Loop through each frame to perform the interpolation
     for (int i = 1; i <= fps; i++) {
-        // Calculate the weight for interpolation
-        double weight = (double)i / fps;
-
-        // Create a new surface for the interpolated frame
-        cairo_surface_t *interpolated_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, LUT_W, LUT_H);
-        cairo_t *cr = cairo_create(interpolated_surface);
-
-        cairo_surface_flush(interpolated_surface);
-        unsigned char *interpolated_data = cairo_image_surface_get_data(interpolated_surface);
-
-        for (int y = 0; y < LUT_H; y++) {
-            for (int x = 0; x < LUT_W; x++) {
-                int offset = (y * LUT_W + x) * 4; // 4 bytes per pixel for ARGB
+        // Weight of the second frame, i / fps rounded to 8.8 fixed point
+        int weight = (i * BLEND_ONE + fps / 2) / fps;
 
-                unsigned char *first_pixel = first_data + offset;
-                unsigned char *second_pixel = second_data + offset;
-
-                unsigned char first_a = first_pixel[3];
-                unsigned char first_r = first_pixel[2];
-                unsigned char first_g = first_pixel[1];
-                unsigned char first_b = first_pixel[0];
-
-                unsigned char second_a = second_pixel[3];
-                unsigned char second_r = second_pixel[2];
-                unsigned char second_g = second_pixel[1];
-                unsigned char second_b = second_pixel[0];
-
-                // Interpolate each channel individually
-                unsigned char interpolated_a = (unsigned char)(weight * second_a + (1 - weight) * first_a);
-                unsigned char interpolated_r = (unsigned char)(weight * second_r + (1 - weight) * first_r);
-                unsigned char interpolated_g = (unsigned char)(weight * second_g + (1 - weight) * first_g);
-                unsigned char interpolated_b = (unsigned char)(weight * second_b + (1 - weight) * first_b);
-
-                // Combine interpolated channels back into a single 32-bit ARGB color
-                uint32_t interpolated_color = (interpolated_a << 24) | (interpolated_r << 16) | (interpolated_g << 8) | interpolated_b;
-
-                // Set the interpolated color to the new cairo surface
-                *(uint32_t *)(interpolated_data + offset) = interpolated_color;
-            }
-        }
-
-        // Mark the surface as dirty as we have modified it at the pixel level
-        cairo_surface_mark_dirty(interpolated_surface);
-
-        // Save the interpolated frame
-        add_frame_to_animation_context(ctx, interpolated_surface);
-        // Cleanup
-        cairo_destroy(cr);
+        blend_pixels(add_frame_to_animation_context(ctx), first_copy, second_copy, frame_size, weight);
     }
 }
 
-// Separate function that creates a random frame without adding it to the context
-cairo_surface_t* create_random_color_frame() {
-    cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, LUT_W, LUT_H);
-    unsigned char *data = cairo_image_surface_get_data(surface);
-
-    for (int y = 0; y < LUT_H; y++) {
-        for (int x = 0; x < LUT_W; x++) {
-            // Generate random colors in the range [0, 255]
-            int r = rand() % 256;
-            int g = rand() % 256;
-            int b = rand() % 256;
-
-            // Apply the first rule: If all are greater than 0.5, set the smallest to 0
-            if (r > 127 && g > 127 && b > 127) {
-                if (r <= g && r <= b) r = 0;
-                else if (g <= r && g <= b) g = 0;
-                else b = 0;
-            }
-
-            // Apply the second rule: if all are close to each other, modify accordingly
-            if (abs(r - g) < 50 && abs(r - b) < 50 && abs(g - b) < 50) {
-                if (r <= g && r <= b) r = 0;
-                else if (g <= r && g <= b) g = 0;
-                else b = 0;
-
-                if (r >= g && r >= b) r = 255;
-                else if (g >= r && g >= b) g = 255;
-                else b = 255;
-            }
-
-            // Compute the pixel offset
-            int offset = (y * LUT_W + x) * 4; // 4 bytes per pixel for ARGB
-
-            data[offset] = b;       // Blue channel
-            data[offset + 1] = g;   // Green channel
-            data[offset + 2] = r;   // Red channel
-            data[offset + 3] = 255; // Alpha channel (fully opaque)
-        }
-    }
-
-    cairo_surface_mark_dirty(surface);
-    return surface;
-}
-
 void make_random_color_sequence(AnimationContext *ctx, int num_frames, int fps) {
     if (num_frames < 2) {
         // Not enough frames for interpolation
         return;
     }
 
+    // Every random frame but the first is preceded by fps interpolated ones
+    reserve_animation_frames(ctx, ctx->frame_count + 1 + (num_frames - 1) * (fps + 1));
+
     srand(time(NULL));
     // Generate the first random frame
     draw_random_color_frame(ctx);
 
     for (int i = 1; i < num_frames; ++i) {
         // Generate the next random frame, but don't add it to the list yet
-        cairo_surface_t *next_surface = create_random_color_frame();
+        uint32_t next_canvas[LUT_LEN];
+        uint32_t next_frame[LUT_LEN];
+        create_random_color_frame((unsigned char *)next_canvas);
+        canvas_to_frame(ctx, next_canvas, next_frame);
 
         // Interpolate between the last frame in the list and the next random frame
-        cairo_surface_t *current_surface = ctx->frames[ctx->frame_count - 1];
-        smooth_interpolate_between_frames(current_surface, next_surface, ctx, fps);
+        const uint32_t *current_frame = animation_frame(ctx, ctx->frame_count - 1);
+        smooth_interpolate_between_frames(current_frame, next_frame, ctx, fps);
 
         // Now add the next random frame to the list
-        add_frame_to_animation_context(ctx, next_surface);
+        memcpy(add_frame_to_animation_context(ctx), next_frame, animation_frame_size(ctx) * sizeof(uint32_t));
     }
 }
 
 void clear_animation(AnimationContext *ctx) {
-    for (int i = 0; i < ctx->frame_count; i++) {
-        cairo_surface_destroy(ctx->frames[i]);
-    }
-    free(ctx->frames);
-    ctx->frames = NULL;
+    // All frames live in the one slab
+    free(ctx->pixels);
+    ctx->pixels = NULL;
     ctx->frame_count = 0;
+    ctx->max_frames = 0;
     ctx->current_frame = 0;
     ctx->direction = 1;  // or whatever your initial direction is
 }
@@ -1,6 +1,7 @@
 #ifndef __ANIMATIONS_H__
 #define __ANIMATIONS_H__
 
+#include <stddef.h>
 #include <stdint.h>
 #include <cairo/cairo.h>
 #include "ws2811.h"
@@ -18,6 +19,8 @@ extern "C" {
 #define __ -1// full canvas including missing pixels (marked as __)
 // LUT currently nased of prototype (2:1 ratio, skipping every other pixel)
 extern const int LUT[LUT_LEN];
+// LEDs the LUT maps to, numbered 0 to LUT_LED_COUNT - 1
+#define LUT_LED_COUNT 54
 
 enum AnimationType {
     GROWING_ELLIPSE,
@@ -27,25 +30,46 @@ enum AnimationType {
     NONE  // Initially, no animation is set
 };
 
+// Frames are stored back to back in one slab, a cairo surface is only
+// created over a canvas while drawing into it.  With led_count set, every
+// frame is mapped through the LUT once when it is added and stored as
+// led_count LED values in strip order, which playback copies as is.
+// Otherwise frames are whole ARGB32 canvases.
 typedef struct {
-    cairo_surface_t **frames;
+    uint32_t *pixels;      // frame_count frames of animation_frame_size() values each
     int frame_count;
-    int max_frames;
+    int max_frames;        // frames the slab has room for
     int current_frame;
     int direction;
+    int led_count;         // LEDs per frame, at most LUT_LEN, 0 to keep canvases
 } AnimationContext;
 
+static inline int animation_frame_size(const AnimationContext *ctx) {
+    return ctx->led_count ? ctx->led_count : LUT_LEN;
+}
+
+static inline uint32_t *animation_frame(const AnimationContext *ctx, int index) {
+    return ctx->pixels + (size_t)index * animation_frame_size(ctx);
+}
+
 extern AnimationContext anim_ctx;
 
 // Utility functions
-void send_frame_to_neopixels(cairo_surface_t *surface, ws2811_t *ledstring);
+void copy_frame_to_leds(const uint32_t *frame, ws2811_t *ledstring);
+ws2811_return_t send_frame_to_neopixels(const uint32_t *frame, ws2811_t *ledstring);
+void copy_animation_frame_to_leds(const AnimationContext *ctx, int index, ws2811_t *ledstring);
+ws2811_return_t send_animation_frame_to_neopixels(const AnimationContext *ctx, int index, ws2811_t *ledstring);
+void enable_preview(int max_fps);  // Show sent frames in the terminal at most max_fps times a second, 0 for never
+void preview_leds(const ws2811_channel_t *channel);  // Preview channel->leds, when previews are on and one is due
+void preview_animation_frame(const AnimationContext *ctx, int index, ws2811_t *ledstring);  // Same, for a frame sent from the cache
 void smooth_interpolate_to_new_frames(AnimationContext *current_ctx, AnimationContext *new_ctx, AnimationContext *transition_ctx, int fps);
+void reserve_animation_frames(AnimationContext *ctx, int frames);
 void clear_animation(AnimationContext *ctx);
 void insert_frame_to_animation_context_at(AnimationContext *ctx, cairo_surface_t *frame, int index);
 
 void smooth_interpolate_between_frames(
-    cairo_surface_t *first_frame,
-    cairo_surface_t *second_frame,
+    const uint32_t *first_frame,
+    const uint32_t *second_frame,
     AnimationContext *ctx,
     int fps);
 
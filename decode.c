@@ -0,0 +1,242 @@
+/*
+ * decode.c
+ *
+ * Copyright (c) 2014 Jeremy Garff <jer @ jers.net>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#include <stdint.h>
+#include <string.h>
+
+#include "ws2811.h"
+#include "encode.h"
+#include "decode.h"
+
+
+// First and last symbol of the 8 bit patterns in 3 wire bytes, always 1 and 0
+#define DECODE_SYMBOL_HIGH                       0x924924
+#define DECODE_SYMBOL_LOW                        0x249249
+
+
+/**
+ * Number of bytes one channel has in a wire stream.
+ *
+ * @param    bytes   Size of the wire stream.
+ * @param    layout  WS2811_LAYOUT_xxx.
+ *
+ * @returns  Byte count, only whole words for PWM and PCM.
+ */
+static uint32_t channel_bytes(uint32_t bytes, int layout)
+{
+    switch (layout)
+    {
+        case WS2811_LAYOUT_PWM:
+            return (bytes / (2 * sizeof(uint32_t))) * sizeof(uint32_t);
+
+        case WS2811_LAYOUT_PCM:
+            return (bytes / sizeof(uint32_t)) * sizeof(uint32_t);
+
+        default:
+            return bytes;
+    }
+}
+
+/**
+ * Fetch a byte of one channel in transmission order.  PWM and PCM shift out
+ * words MSB first, with the PWM channels alternating word by word.
+ *
+ * @param    stream  Wire stream.
+ * @param    layout  WS2811_LAYOUT_xxx.
+ * @param    chan    Channel number, always 0 for PCM and SPI.
+ * @param    pos     Byte position within the channel.
+ *
+ * @returns  Wire byte.
+ */
+static uint8_t channel_byte(const uint8_t *stream, int layout, int chan, uint32_t pos)
+{
+    uint32_t word;
+
+    if (layout == WS2811_LAYOUT_SPI)
+    {
+        return stream[pos];
+    }
+
+    if (layout == WS2811_LAYOUT_PWM)
+    {
+        memcpy(&word, &stream[((pos / 4) * 2 + chan) * sizeof(word)], sizeof(word));
+    }
+    else
+    {
+        memcpy(&word, &stream[(pos / 4) * sizeof(word)], sizeof(word));
+    }
+
+    return word >> (24 - ((pos % 4) * 8));
+}
+
+/**
+ * Decode wire bytes back into colour bytes.  Bytes that aren't made of the
+ * 100 and 110 symbols are decoded from their middle symbols anyway.
+ *
+ * @param    wire     Wire bytes in transmission order, 3 per colour byte.
+ * @param    colours  Decoded colour bytes.
+ * @param    count    Number of colour bytes.
+ * @param    invert   0xff if the wire bytes are inverted, 0 otherwise.
+ *
+ * @returns  Number of colour bytes with bad symbols.
+ */
+int decode_colour_bytes(const uint8_t *wire, uint8_t *colours, int count, uint8_t invert)
+{
+    int bad = 0;
+    int i, k;
+
+    for (i = 0; i < count; i++)
+    {
+        const uint32_t v = ((uint32_t)(wire[0] ^ invert) << 16) |
+                           ((uint32_t)(wire[1] ^ invert) << 8) |
+                           (uint32_t)(wire[2] ^ invert);
+        uint8_t colour = 0;
+
+        if (((v & DECODE_SYMBOL_HIGH) != DECODE_SYMBOL_HIGH) || (v & DECODE_SYMBOL_LOW))
+        {
+            bad++;
+        }
+
+        for (k = 0; k < 8; k++)
+        {
+            colour = (colour << 1) | ((v >> (22 - (k * 3))) & 1);
+        }
+
+        colours[i] = colour;
+        wire += ENCODE_BYTES_PER_COLOUR;
+    }
+
+    return bad;
+}
+
+/**
+ * Decode the LEDs of one channel from a wire stream and measure the reset
+ * time that follows them.  The LED data ends at the first 3 wire bytes that
+ * are all zero, which the line never idles for while sending a colour byte.
+ *
+ * @param    stream      Wire stream, as built in pxl_raw or read from a capture.
+ * @param    bytes       Size of the wire stream.
+ * @param    layout      WS2811_LAYOUT_xxx.
+ * @param    chan        Channel number, 0 or 1 for PWM, 0 otherwise.
+ * @param    invert      Inverted by software, as done for PCM and SPI.
+ * @param    freq        Output frequency, 3 symbols per bit.
+ * @param    strip_type  Colour order of the strip.
+ * @param    leds        Decoded LED values, may be NULL.
+ * @param    max_leds    Size of leds.
+ * @param    result      Decoding result.
+ *
+ * @returns  0 on success, -1 for an invalid layout or channel.
+ */
+int decode_channel(const uint8_t *stream, uint32_t bytes, int layout, int chan, int invert,
+                   uint32_t freq, uint32_t strip_type, ws2811_led_t *leds, int max_leds,
+                   decode_result_t *result)
+{
+    const int colours = (strip_type & SK6812_SHIFT_WMASK) ? 4 : 3;
+    const int shifts[4] = {
+        (strip_type >> 16) & 0xff,
+        (strip_type >> 8) & 0xff,
+        strip_type & 0xff,
+        (strip_type >> 24) & 0xff,
+    };
+    const uint8_t mask = invert ? 0xff : 0;
+    uint32_t size, pos;
+    ws2811_led_t led = 0;
+
+    if ((layout < WS2811_LAYOUT_PWM) || (layout > WS2811_LAYOUT_SPI) ||
+        (chan < 0) || (chan > ((layout == WS2811_LAYOUT_PWM) ? 1 : 0)) || !freq)
+    {
+        return -1;
+    }
+
+    memset(result, 0, sizeof(*result));
+    result->first_bad = -1;
+
+    size = channel_bytes(bytes, layout);
+
+    for (pos = 0; pos + ENCODE_BYTES_PER_COLOUR <= size; pos += ENCODE_BYTES_PER_COLOUR)
+    {
+        uint8_t wire[ENCODE_BYTES_PER_COLOUR];
+        uint8_t colour;
+        int i;
+
+        for (i = 0; i < ENCODE_BYTES_PER_COLOUR; i++)
+        {
+            wire[i] = channel_byte(stream, layout, chan, pos + i);
+        }
+
+        if (!wire[0] && !wire[1] && !wire[2])
+        {
+            break;
+        }
+
+        if (decode_colour_bytes(wire, &colour, 1, mask) && !result->bad_symbols++)
+        {
+            result->first_bad = result->colours;
+        }
+
+        led |= (ws2811_led_t)colour << shifts[result->colours % colours];
+
+        if (!(++result->colours % colours))
+        {
+            if (leds && (result->leds < max_leds))
+            {
+                leds[result->leds] = led;
+            }
+
+            result->leds++;
+            led = 0;
+        }
+    }
+
+    // Count the idle symbols up to the end of the stream or the next high symbol
+    for (; pos < size; pos++)
+    {
+        const uint8_t byte = channel_byte(stream, layout, chan, pos);
+
+        if (byte)
+        {
+            int bit;
+
+            for (bit = 7; !(byte & (1 << bit)); bit--)
+            {
+                result->reset_bits++;
+            }
+
+            break;
+        }
+
+        result->reset_bits += 8;
+    }
+
+    result->reset_us = ((uint64_t)result->reset_bits * 1000000) / (freq * 3);
+    result->reset_ok = result->reset_us >= WS2811_RESET_US;
+
+    return 0;
+}
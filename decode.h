@@ -0,0 +1,75 @@
+/*
+ * decode.h
+ *
+ * Copyright (c) 2014 Jeremy Garff <jer @ jers.net>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef __DECODE_H__
+#define __DECODE_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include "ws2811.h"
+
+/*
+ * Wire stream decoder
+ *
+ * Turns an encoded buffer back into LED values, for checking encoders and
+ * inspecting captures.  The stream is read in one of the WS2811_LAYOUT_xxx
+ * layouts, 32-bit words MSB first for PWM and PCM and bytes for SPI, with the
+ * channels interleaved word by word for PWM.  Every 3 wire bytes of a channel
+ * carry one colour byte as 8 symbols, 100 for 0 and 110 for 1.  The LED data
+ * ends at the first 3 wire bytes that are all zero, the idle line after it is
+ * the reset time.  Values come out as the strip receives them, after
+ * brightness and gamma correction.
+ */
+
+typedef struct
+{
+    int leds;                                    //< Whole LEDs decoded
+    int colours;                                 //< Colour bytes decoded, a multiple of 3 or 4 unless truncated
+    int bad_symbols;                             //< Colour bytes with symbols other than 100 and 110
+    int first_bad;                               //< Index of the first bad colour byte, -1 if none
+    uint32_t reset_bits;                         //< Idle symbols after the LED data
+    uint32_t reset_us;                           //< Length of the reset time
+    int reset_ok;                                //< reset_us is at least WS2811_RESET_US
+} decode_result_t;
+
+int decode_channel(const uint8_t *stream, uint32_t bytes, int layout, int chan, int invert,
+                   uint32_t freq, uint32_t strip_type, ws2811_led_t *leds, int max_leds,
+                   decode_result_t *result);                                    //< Decode one channel, 0 on success
+int decode_colour_bytes(const uint8_t *wire, uint8_t *colours, int count,
+                        uint8_t invert);                                        //< Decode wire bytes in transmission order, returns bad colour bytes
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __DECODE_H__ */
@@ -75,4 +75,17 @@ uint32_t dmanum_to_offset(int dmanum)
     return dma_offset[dmanum];
 }
 
+uint32_t dmanum_max_txfr(int dmanum)
+{
+    if (dmanum_is_lite(dmanum))
+    {
+        return DMA_LITE_MAX_TXFR;
+    }
 
+    return DMA_MAX_TXFR;
+}
+
+int dmanum_is_lite(int dmanum)
+{
+    return (dmanum >= 7) && (dmanum <= 14);
+}
@@ -96,6 +96,12 @@ typedef struct
 #define RPI_DMA_STRIDE_S_STRIDE(val)             ((val & 0xffff) << 0)
     uint32_t nextconbk;
     uint32_t debug;
+#define RPI_DMA_DEBUG_READ_ERROR                 (1 << 2)
+#define RPI_DMA_DEBUG_FIFO_ERROR                 (1 << 1)
+#define RPI_DMA_DEBUG_READ_LAST_NOT_SET_ERROR    (1 << 0)
+#define RPI_DMA_DEBUG_ERRORS                     (RPI_DMA_DEBUG_READ_ERROR | \
+                                                  RPI_DMA_DEBUG_FIFO_ERROR | \
+                                                  RPI_DMA_DEBUG_READ_LAST_NOT_SET_ERROR)
 } __attribute__((packed, aligned(4))) dma_t;
 
 
@@ -117,11 +123,21 @@ typedef struct
 #define DMA15_OFFSET                             (0x00e05000)
 
 
+// Channels 7 to 14 are DMA Lite engines, which only have a 16-bit transfer length and
+// no 2D mode.  Both limits are kept a multiple of 8 so the PWM channel word pairs aren't split.
+#define DMA_LITE_MAX_TXFR                        (65536 - 8)
+#define DMA_MAX_TXFR                             ((1 << 30) - 8)
+// 2D mode transfers YLENGTH + 1 rows of XLENGTH bytes
+#define DMA_MAX_YLENGTH                          0x3fff
+
+
 #define PAGE_SIZE                                (1 << 12)
 #define PAGE_MASK                                (~(PAGE_SIZE - 1))
 #define PAGE_OFFSET(page)                        (page & (PAGE_SIZE - 1))
 
 
 uint32_t dmanum_to_offset(int dmanum);
+uint32_t dmanum_max_txfr(int dmanum);
+int dmanum_is_lite(int dmanum);
 
 #endif /* __DMA_H__ */
@@ -0,0 +1,756 @@
+/*
+ * encode.c
+ *
+ * Copyright (c) 2014 Jeremy Garff <jer @ jers.net>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ENCODE_X86
+#endif
+
+#include "ws2811.h"
+#include "encode.h"
+
+
+/*
+ * Reference lookup table.  convert_table[n][byte] is the n-th wire byte of the
+ * 3 symbol per bit pattern for the given colour byte.
+ */
+static const uint8_t convert_table[3][256] =
+{
+    {
+        0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92,
+        0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92,
+        0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x93, 0x93, 0x93,
+        0x93, 0x93, 0x93, 0x93, 0x93, 0x93, 0x93, 0x93, 0x93, 0x93, 0x93, 0x93, 0x93,
+        0x93, 0x93, 0x93, 0x93, 0x93, 0x93, 0x93, 0x93, 0x93, 0x93, 0x93, 0x93, 0x93,
+        0x93, 0x93, 0x93, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A,
+        0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A,
+        0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9B, 0x9B, 0x9B, 0x9B,
+        0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 0x9B,
+        0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 0x9B,
+        0x9B, 0x9B, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2,
+        0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2,
+        0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3,
+        0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3,
+        0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3,
+        0xD3, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA,
+        0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA,
+        0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB,
+        0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB,
+        0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB
+    },
+    {
+        0x49, 0x49, 0x49, 0x49, 0x49, 0x49, 0x49, 0x49, 0x4D,
+        0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x69, 0x69, 0x69, 0x69, 0x69, 0x69,
+        0x69, 0x69, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x49, 0x49, 0x49,
+        0x49, 0x49, 0x49, 0x49, 0x49, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D,
+        0x69, 0x69, 0x69, 0x69, 0x69, 0x69, 0x69, 0x69, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D,
+        0x6D, 0x6D, 0x6D, 0x49, 0x49, 0x49, 0x49, 0x49, 0x49, 0x49, 0x49, 0x4D, 0x4D,
+        0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x69, 0x69, 0x69, 0x69, 0x69, 0x69, 0x69,
+        0x69, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x49, 0x49, 0x49, 0x49,
+        0x49, 0x49, 0x49, 0x49, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x69,
+        0x69, 0x69, 0x69, 0x69, 0x69, 0x69, 0x69, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D,
+        0x6D, 0x6D, 0x49, 0x49, 0x49, 0x49, 0x49, 0x49, 0x49, 0x49, 0x4D, 0x4D, 0x4D,
+        0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x69, 0x69, 0x69, 0x69, 0x69, 0x69, 0x69, 0x69,
+        0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x49, 0x49, 0x49, 0x49, 0x49,
+        0x49, 0x49, 0x49, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x69, 0x69,
+        0x69, 0x69, 0x69, 0x69, 0x69, 0x69, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D,
+        0x6D, 0x49, 0x49, 0x49, 0x49, 0x49, 0x49, 0x49, 0x49, 0x4D, 0x4D, 0x4D, 0x4D,
+        0x4D, 0x4D, 0x4D, 0x4D, 0x69, 0x69, 0x69, 0x69, 0x69, 0x69, 0x69, 0x69, 0x6D,
+        0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x49, 0x49, 0x49, 0x49, 0x49, 0x49,
+        0x49, 0x49, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x69, 0x69, 0x69,
+        0x69, 0x69, 0x69, 0x69, 0x69, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D
+    },
+    {
+        0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24,
+        0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6,
+        0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34,
+        0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6,
+        0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4,
+        0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26,
+        0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4,
+        0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36,
+        0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24,
+        0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6,
+        0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34,
+        0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6,
+        0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4,
+        0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26,
+        0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4,
+        0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36,
+        0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24,
+        0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6,
+        0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34,
+        0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6
+    }
+};
+
+/*
+ * Bit n of a colour byte becomes the middle symbol of the n-th 3 bit group,
+ * the outer symbols are always 1 and 0.  Building the table with macros keeps
+ * it const and free of any runtime initialisation.
+ */
+#define EXPAND_BIT(val, bit)                     ((((val) >> (bit)) & 1) << (3 * (bit) + 1))
+#define EXPAND(val)                              (0x924924 | \
+                                                  EXPAND_BIT(val, 0) | EXPAND_BIT(val, 1) | \
+                                                  EXPAND_BIT(val, 2) | EXPAND_BIT(val, 3) | \
+                                                  EXPAND_BIT(val, 4) | EXPAND_BIT(val, 5) | \
+                                                  EXPAND_BIT(val, 6) | EXPAND_BIT(val, 7))
+#define EXPAND4(val)                             EXPAND(val), EXPAND(val + 1), EXPAND(val + 2), EXPAND(val + 3)
+#define EXPAND16(val)                            EXPAND4(val), EXPAND4(val + 4), EXPAND4(val + 8), EXPAND4(val + 12)
+#define EXPAND64(val)                            EXPAND16(val), EXPAND16(val + 16), EXPAND16(val + 32), EXPAND16(val + 48)
+
+static const uint32_t expand_table[256] =
+{
+    EXPAND64(0), EXPAND64(64), EXPAND64(128), EXPAND64(192),
+};
+
+/*
+ * Wire byte values indexed by the colour bits that select them.  Byte 0 is
+ * picked by bits 7-5, byte 1 by bits 4-3 and byte 2 by bits 2-0.
+ */
+static const uint8_t symbol_lut[3][8] =
+{
+    { 0x92, 0x93, 0x9a, 0x9b, 0xd2, 0xd3, 0xda, 0xdb },
+    { 0x49, 0x4d, 0x69, 0x6d, 0x49, 0x4d, 0x69, 0x6d },
+    { 0x24, 0x26, 0x34, 0x36, 0xa4, 0xa6, 0xb4, 0xb6 },
+};
+
+
+static inline uint32_t load_be32(const uint8_t *src)
+{
+    uint32_t val;
+
+    memcpy(&val, src, sizeof(val));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    val = __builtin_bswap32(val);
+#endif
+
+    return val;
+}
+
+static inline void store_be32(uint8_t *dst, uint32_t val)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    val = __builtin_bswap32(val);
+#endif
+    memcpy(dst, &val, sizeof(val));
+}
+
+/**
+ * Expand colour bytes one wire byte at a time using the reference table.
+ *
+ * @param    dst    Output buffer, 3 * count bytes.
+ * @param    src    Colour bytes.
+ * @param    count  Number of colour bytes.
+ *
+ * @returns  None
+ */
+static void encode_table(uint8_t *dst, const uint8_t *src, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+    {
+        *dst++ = convert_table[0][src[i]];
+        *dst++ = convert_table[1][src[i]];
+        *dst++ = convert_table[2][src[i]];
+    }
+}
+
+/**
+ * Expand colour bytes through the 24-bit table, packing 4 colours into 3 words.
+ * This is the fallback for CPUs without SIMD, such as the ARM1176 in the Pi Zero.
+ *
+ * @param    dst    Output buffer, 3 * count bytes.
+ * @param    src    Colour bytes.
+ * @param    count  Number of colour bytes.
+ *
+ * @returns  None
+ */
+static void encode_swar(uint8_t *dst, const uint8_t *src, int count)
+{
+    for (; count >= 4; count -= 4)
+    {
+        uint32_t e0 = expand_table[src[0]];
+        uint32_t e1 = expand_table[src[1]];
+        uint32_t e2 = expand_table[src[2]];
+        uint32_t e3 = expand_table[src[3]];
+
+        store_be32(dst + 0, (e0 << 8) | (e1 >> 16));
+        store_be32(dst + 4, (e1 << 16) | (e2 >> 8));
+        store_be32(dst + 8, (e2 << 24) | e3);
+
+        src += 4;
+        dst += 12;
+    }
+
+    encode_table(dst, src, count);
+}
+
+#if defined(__ARM_NEON)
+/**
+ * Expand colour bytes with NEON table lookups, the 3-way interleave is done by vst3.
+ * Only 64-bit vtbl is used so the same code builds for ARMv7 and AArch64.
+ *
+ * @param    dst    Output buffer, 3 * count bytes.
+ * @param    src    Colour bytes.
+ * @param    count  Number of colour bytes.
+ *
+ * @returns  None
+ */
+static void encode_neon(uint8_t *dst, const uint8_t *src, int count)
+{
+    const uint8x8_t lut0 = vld1_u8(symbol_lut[0]);
+    const uint8x8_t lut1 = vld1_u8(symbol_lut[1]);
+    const uint8x8_t lut2 = vld1_u8(symbol_lut[2]);
+    const uint8x8_t mask3 = vdup_n_u8(0x03);
+    const uint8x8_t mask7 = vdup_n_u8(0x07);
+
+    for (; count >= 8; count -= 8)
+    {
+        uint8x8_t val = vld1_u8(src);
+        uint8x8x3_t out;
+
+        out.val[0] = vtbl1_u8(lut0, vshr_n_u8(val, 5));
+        out.val[1] = vtbl1_u8(lut1, vand_u8(vshr_n_u8(val, 3), mask3));
+        out.val[2] = vtbl1_u8(lut2, vand_u8(val, mask7));
+        vst3_u8(dst, out);
+
+        src += 8;
+        dst += 24;
+    }
+
+    encode_swar(dst, src, count);
+}
+#endif
+
+#if defined(ENCODE_X86)
+#define Z                                        -1
+
+/*
+ * pshufb masks spreading the 16 lanes of wire byte 0, 1 and 2 over the three
+ * 16 byte output vectors.
+ */
+#define SSSE3_INTERLEAVE_MASKS                                                                  \
+    const __m128i m0a = _mm_setr_epi8( 0,  Z,  Z,  1,  Z,  Z,  2,  Z,  Z,  3,  Z,  Z,  4,  Z,  Z,  5); \
+    const __m128i m0b = _mm_setr_epi8( Z,  0,  Z,  Z,  1,  Z,  Z,  2,  Z,  Z,  3,  Z,  Z,  4,  Z,  Z); \
+    const __m128i m0c = _mm_setr_epi8( Z,  Z,  0,  Z,  Z,  1,  Z,  Z,  2,  Z,  Z,  3,  Z,  Z,  4,  Z); \
+    const __m128i m1a = _mm_setr_epi8( Z,  Z,  6,  Z,  Z,  7,  Z,  Z,  8,  Z,  Z,  9,  Z,  Z, 10,  Z); \
+    const __m128i m1b = _mm_setr_epi8( 5,  Z,  Z,  6,  Z,  Z,  7,  Z,  Z,  8,  Z,  Z,  9,  Z,  Z, 10); \
+    const __m128i m1c = _mm_setr_epi8( Z,  5,  Z,  Z,  6,  Z,  Z,  7,  Z,  Z,  8,  Z,  Z,  9,  Z,  Z); \
+    const __m128i m2a = _mm_setr_epi8( Z, 11,  Z,  Z, 12,  Z,  Z, 13,  Z,  Z, 14,  Z,  Z, 15,  Z,  Z); \
+    const __m128i m2b = _mm_setr_epi8( Z,  Z, 11,  Z,  Z, 12,  Z,  Z, 13,  Z,  Z, 14,  Z,  Z, 15,  Z); \
+    const __m128i m2c = _mm_setr_epi8(10,  Z,  Z, 11,  Z,  Z, 12,  Z,  Z, 13,  Z,  Z, 14,  Z,  Z, 15)
+
+#define SSSE3_INTERLEAVE_STORE(dst, a, b, c)                                                    \
+    do {                                                                                        \
+        _mm_storeu_si128((__m128i *)((dst) + 0),                                                \
+                         _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, m0a),                    \
+                                                   _mm_shuffle_epi8(b, m0b)),                   \
+                                      _mm_shuffle_epi8(c, m0c)));                               \
+        _mm_storeu_si128((__m128i *)((dst) + 16),                                               \
+                         _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, m1a),                    \
+                                                   _mm_shuffle_epi8(b, m1b)),                   \
+                                      _mm_shuffle_epi8(c, m1c)));                               \
+        _mm_storeu_si128((__m128i *)((dst) + 32),                                               \
+                         _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, m2a),                    \
+                                                   _mm_shuffle_epi8(b, m2b)),                   \
+                                      _mm_shuffle_epi8(c, m2c)));                               \
+    } while (0)
+
+/**
+ * Expand colour bytes with SSSE3 pshufb lookups, 16 colours per iteration.
+ *
+ * @param    dst    Output buffer, 3 * count bytes.
+ * @param    src    Colour bytes.
+ * @param    count  Number of colour bytes.
+ *
+ * @returns  None
+ */
+__attribute__((target("ssse3")))
+static void encode_ssse3(uint8_t *dst, const uint8_t *src, int count)
+{
+    const __m128i lut0 = _mm_loadl_epi64((const __m128i *)symbol_lut[0]);
+    const __m128i lut1 = _mm_loadl_epi64((const __m128i *)symbol_lut[1]);
+    const __m128i lut2 = _mm_loadl_epi64((const __m128i *)symbol_lut[2]);
+    const __m128i mask3 = _mm_set1_epi8(0x03);
+    const __m128i mask7 = _mm_set1_epi8(0x07);
+    SSSE3_INTERLEAVE_MASKS;
+
+    for (; count >= 16; count -= 16)
+    {
+        __m128i val = _mm_loadu_si128((const __m128i *)src);
+        __m128i a = _mm_shuffle_epi8(lut0, _mm_and_si128(_mm_srli_epi16(val, 5), mask7));
+        __m128i b = _mm_shuffle_epi8(lut1, _mm_and_si128(_mm_srli_epi16(val, 3), mask3));
+        __m128i c = _mm_shuffle_epi8(lut2, _mm_and_si128(val, mask7));
+
+        SSSE3_INTERLEAVE_STORE(dst, a, b, c);
+
+        src += 16;
+        dst += 48;
+    }
+
+    encode_swar(dst, src, count);
+}
+
+/**
+ * Expand colour bytes with AVX2, 32 lookups per iteration.  vpshufb only works
+ * within 128-bit lanes, so each lane is interleaved and stored separately.
+ *
+ * @param    dst    Output buffer, 3 * count bytes.
+ * @param    src    Colour bytes.
+ * @param    count  Number of colour bytes.
+ *
+ * @returns  None
+ */
+__attribute__((target("avx2")))
+static void encode_avx2(uint8_t *dst, const uint8_t *src, int count)
+{
+    const __m256i lut0 = _mm256_broadcastsi128_si256(_mm_loadl_epi64((const __m128i *)symbol_lut[0]));
+    const __m256i lut1 = _mm256_broadcastsi128_si256(_mm_loadl_epi64((const __m128i *)symbol_lut[1]));
+    const __m256i lut2 = _mm256_broadcastsi128_si256(_mm_loadl_epi64((const __m128i *)symbol_lut[2]));
+    const __m256i mask3 = _mm256_set1_epi8(0x03);
+    const __m256i mask7 = _mm256_set1_epi8(0x07);
+    SSSE3_INTERLEAVE_MASKS;
+
+    for (; count >= 32; count -= 32)
+    {
+        __m256i val = _mm256_loadu_si256((const __m256i *)src);
+        __m256i a = _mm256_shuffle_epi8(lut0, _mm256_and_si256(_mm256_srli_epi16(val, 5), mask7));
+        __m256i b = _mm256_shuffle_epi8(lut1, _mm256_and_si256(_mm256_srli_epi16(val, 3), mask3));
+        __m256i c = _mm256_shuffle_epi8(lut2, _mm256_and_si256(val, mask7));
+        __m128i a0 = _mm256_castsi256_si128(a), a1 = _mm256_extracti128_si256(a, 1);
+        __m128i b0 = _mm256_castsi256_si128(b), b1 = _mm256_extracti128_si256(b, 1);
+        __m128i c0 = _mm256_castsi256_si128(c), c1 = _mm256_extracti128_si256(c, 1);
+
+        SSSE3_INTERLEAVE_STORE(dst, a0, b0, c0);
+        SSSE3_INTERLEAVE_STORE(dst + 48, a1, b1, c1);
+
+        src += 32;
+        dst += 96;
+    }
+
+    encode_ssse3(dst, src, count);
+}
+
+#undef Z
+#endif /* ENCODE_X86 */
+
+
+/*
+ *
+ * Public API
+ *
+ */
+
+
+/**
+ * Look up an expander implementation.
+ *
+ * @param    impl  One of the ENCODE_IMPL_xxx constants.
+ *
+ * @returns  Expander function, or NULL if impl is not built in or the CPU lacks support.
+ */
+encode_fn_t encode_get_impl(int impl)
+{
+    switch (impl)
+    {
+    case ENCODE_IMPL_TABLE:
+        return encode_table;
+
+    case ENCODE_IMPL_SWAR:
+        return encode_swar;
+
+#if defined(__ARM_NEON)
+    case ENCODE_IMPL_NEON:
+        return encode_neon;
+#endif
+
+#if defined(ENCODE_X86)
+    case ENCODE_IMPL_SSSE3:
+        return __builtin_cpu_supports("ssse3") ? encode_ssse3 : NULL;
+
+    case ENCODE_IMPL_AVX2:
+        return __builtin_cpu_supports("avx2") ? encode_avx2 : NULL;
+#endif
+    }
+
+    return NULL;
+}
+
+/**
+ * Find the fastest expander the running CPU supports.
+ *
+ * @returns  One of the ENCODE_IMPL_xxx constants.
+ */
+int encode_best_impl(void)
+{
+    int impl;
+
+    for (impl = ENCODE_IMPL_COUNT - 1; impl > ENCODE_IMPL_SWAR; impl--)
+    {
+        if (encode_get_impl(impl))
+        {
+            return impl;
+        }
+    }
+
+    return ENCODE_IMPL_SWAR;
+}
+
+const char *encode_impl_name(int impl)
+{
+    static const char * const names[] = { "table", "swar", "neon", "ssse3", "avx2" };
+
+    if ((impl < 0) || (impl >= ENCODE_IMPL_COUNT))
+    {
+        return "";
+    }
+
+    return names[impl];
+}
+
+/**
+ * Expand colour bytes into wire bytes with the fastest available expander.
+ *
+ * @param    dst    Output buffer, 3 * count bytes.
+ * @param    src    Colour bytes.
+ * @param    count  Number of colour bytes.
+ *
+ * @returns  None
+ */
+void encode_symbols(uint8_t *dst, const uint8_t *src, int count)
+{
+    // CPU features don't change at runtime, so instances rendering from different
+    // threads that race on the first call all store the same value
+    static encode_fn_t best;
+    encode_fn_t fn = __atomic_load_n(&best, __ATOMIC_RELAXED);
+
+    if (!fn)
+    {
+        fn = encode_get_impl(encode_best_impl());
+        __atomic_store_n(&best, fn, __ATOMIC_RELAXED);
+    }
+
+    fn(dst, src, count);
+}
+
+/**
+ * Store wire bytes as 32-bit words shifted out MSB first, as used by PWM and PCM.
+ * A trailing partial word is padded with zero bits, which are never inverted.
+ *
+ * @param    dst     First destination word.
+ * @param    stride  Distance in words between consecutive destination words.
+ * @param    src     Wire bytes in transmission order.
+ * @param    len     Number of wire bytes.
+ * @param    invert  Value XORed into every word, 0 or ~0.
+ *
+ * @returns  None
+ */
+static inline __attribute__((always_inline))
+void store_words(volatile uint32_t *dst, int stride, const uint8_t *src, int len, uint32_t invert)
+{
+    int i;
+
+    for (i = 0; i + 4 <= len; i += 4)
+    {
+        *dst = load_be32(src + i) ^ invert;
+        dst += stride;
+    }
+
+    if (i < len)
+    {
+        int tail = len - i;
+        uint32_t word = 0;
+        int j;
+
+        for (j = 0; j < tail; j++)
+        {
+            word |= (uint32_t)src[i + j] << (24 - (8 * j));
+        }
+
+        *dst = word ^ (invert & ~(0xffffffffU >> (8 * tail)));
+    }
+}
+
+/**
+ * Store wire bytes in transmission order, as used by SPI.
+ *
+ * @param    dst     Destination buffer.
+ * @param    src     Wire bytes in transmission order.
+ * @param    len     Number of wire bytes.
+ * @param    invert  Value XORed into every byte, 0 or 0xff.
+ *
+ * @returns  None
+ */
+static inline __attribute__((always_inline))
+void store_bytes(volatile uint8_t *dst, const uint8_t *src, int len, uint8_t invert)
+{
+    int i;
+
+    for (i = 0; i < len; i++)
+    {
+        dst[i] = src[i] ^ invert;
+    }
+}
+
+/**
+ * Interleave the words of two PWM channels, storing the pairs in order.  Words
+ * past the end of the shorter channel are sent as zero.
+ *
+ * @param    dst      First destination word, channel 0.
+ * @param    a        Channel 0 words.
+ * @param    a_words  Number of valid channel 0 words.
+ * @param    b        Channel 1 words.
+ * @param    b_words  Number of valid channel 1 words.
+ * @param    words    Number of word pairs to store.
+ *
+ * @returns  None
+ */
+void encode_interleave_words(volatile uint32_t *dst, const uint32_t *a, int a_words,
+                             const uint32_t *b, int b_words, int words)
+{
+    int both = a_words < b_words ? a_words : b_words;
+    int i;
+
+    if (both > words)
+    {
+        both = words;
+    }
+
+    for (i = 0; i < both; i++)
+    {
+        dst[0] = a[i];
+        dst[1] = b[i];
+        dst += 2;
+    }
+
+    for (; i < words; i++)
+    {
+        dst[0] = i < a_words ? a[i] : 0;
+        dst[1] = i < b_words ? b[i] : 0;
+        dst += 2;
+    }
+}
+
+
+/*
+ * Specialized LED kernels
+ *
+ * encode_leds() is instantiated once for every layout, strip type and invert
+ * setting below.  All three are compile time constants in each instance, so
+ * the shifts, the number of colours, the word stride and the invert value are
+ * folded and the per LED loop has no branches left.  Custom strip types get an
+ * instance per layout and invert setting that takes the strip type at runtime.
+ */
+
+#define KERNEL_CHUNK_LEDS                        64
+
+#define STRIP_TYPES(X)                                                                      \
+            X(WS2811_STRIP_RGB, rgb)                                                        \
+            X(WS2811_STRIP_RBG, rbg)                                                        \
+            X(WS2811_STRIP_GRB, grb)                                                        \
+            X(WS2811_STRIP_GBR, gbr)                                                        \
+            X(WS2811_STRIP_BRG, brg)                                                        \
+            X(WS2811_STRIP_BGR, bgr)                                                        \
+            X(SK6812_STRIP_RGBW, rgbw)                                                      \
+            X(SK6812_STRIP_RBGW, rbgw)                                                      \
+            X(SK6812_STRIP_GRBW, grbw)                                                      \
+            X(SK6812_STRIP_GBRW, gbrw)                                                      \
+            X(SK6812_STRIP_BRGW, brgw)                                                      \
+            X(SK6812_STRIP_BGRW, bgrw)
+
+static inline __attribute__((always_inline))
+void encode_leds(volatile uint8_t *pxl, const uint32_t *leds, const uint8_t *lut, int first,
+                 int count, const int layout, const uint32_t strip_type, const int invert)
+{
+    const int colours = (strip_type & SK6812_SHIFT_WMASK) ? 4 : 3;
+    const int wshift = (strip_type >> 24) & 0xff;
+    const int rshift = (strip_type >> 16) & 0xff;
+    const int gshift = (strip_type >> 8)  & 0xff;
+    const int bshift = (strip_type >> 0)  & 0xff;
+    const int stride = layout == ENCODE_LAYOUT_PWM ? 2 : 1;
+    uint8_t colour[KERNEL_CHUNK_LEDS * 4];
+    uint8_t symbols[KERNEL_CHUNK_LEDS * 4 * ENCODE_BYTES_PER_COLOUR];
+
+    while (count > 0)
+    {
+        const int chunk = count < KERNEL_CHUNK_LEDS ? count : KERNEL_CHUNK_LEDS;
+        const int bytepos = first * colours * ENCODE_BYTES_PER_COLOUR;
+        const int len = chunk * colours * ENCODE_BYTES_PER_COLOUR;
+        int i;
+
+        for (i = 0; i < chunk; i++)
+        {
+            uint32_t led = leds[first + i];
+            uint8_t *c = &colour[i * colours];
+
+            c[0] = lut[(led >> rshift) & 0xff];             // red
+            c[1] = lut[(led >> gshift) & 0xff];             // green
+            c[2] = lut[(led >> bshift) & 0xff];             // blue
+            if (colours == 4)
+            {
+                c[3] = lut[(led >> wshift) & 0xff];         // white
+            }
+        }
+
+        encode_symbols(symbols, colour, chunk * colours);
+
+        if (layout == ENCODE_LAYOUT_SPI)
+        {
+            store_bytes(&pxl[bytepos], symbols, len, invert ? 0xff : 0);
+        }
+        else
+        {
+            store_words((volatile uint32_t *)pxl + ((bytepos / sizeof(uint32_t)) * stride),
+                        stride, symbols, len, invert ? ~0U : 0);
+        }
+
+        first += chunk;
+        count -= chunk;
+    }
+}
+
+#define DEFINE_KERNEL(name, layout, strip_type, invert)                                     \
+    static void kernel_##name(volatile uint8_t *pxl, const uint32_t *leds,                 \
+                              const uint8_t *lut, int first, int count, uint32_t custom)    \
+    {                                                                                       \
+        (void)custom;                                                                       \
+        encode_leds(pxl, leds, lut, first, count, layout, strip_type, invert);              \
+    }
+
+#define DEFINE_CUSTOM_KERNEL(name, layout, invert)                                          \
+    static void kernel_##name(volatile uint8_t *pxl, const uint32_t *leds,                 \
+                              const uint8_t *lut, int first, int count, uint32_t custom)    \
+    {                                                                                       \
+        encode_leds(pxl, leds, lut, first, count, layout, custom, invert);                  \
+    }
+
+// PWM inverts in the hardware, so it has no inverted kernels
+#define DEFINE_KERNELS(strip_type, name)                                                    \
+    DEFINE_KERNEL(pwm_##name, ENCODE_LAYOUT_PWM, strip_type, 0)                             \
+    DEFINE_KERNEL(pcm_##name, ENCODE_LAYOUT_PCM, strip_type, 0)                             \
+    DEFINE_KERNEL(pcm_##name##_inv, ENCODE_LAYOUT_PCM, strip_type, 1)                       \
+    DEFINE_KERNEL(spi_##name, ENCODE_LAYOUT_SPI, strip_type, 0)                             \
+    DEFINE_KERNEL(spi_##name##_inv, ENCODE_LAYOUT_SPI, strip_type, 1)
+
+STRIP_TYPES(DEFINE_KERNELS)
+
+DEFINE_CUSTOM_KERNEL(pwm_custom, ENCODE_LAYOUT_PWM, 0)
+DEFINE_CUSTOM_KERNEL(pcm_custom, ENCODE_LAYOUT_PCM, 0)
+DEFINE_CUSTOM_KERNEL(pcm_custom_inv, ENCODE_LAYOUT_PCM, 1)
+DEFINE_CUSTOM_KERNEL(spi_custom, ENCODE_LAYOUT_SPI, 0)
+DEFINE_CUSTOM_KERNEL(spi_custom_inv, ENCODE_LAYOUT_SPI, 1)
+
+#define KERNEL_ENTRY(name, layout, strip_type, invert)                                      \
+    { kernel_##name, #name, layout, strip_type, invert },
+
+#define KERNEL_ENTRIES(strip_type, name)                                                    \
+    KERNEL_ENTRY(pwm_##name, ENCODE_LAYOUT_PWM, strip_type, 0)                              \
+    KERNEL_ENTRY(pcm_##name, ENCODE_LAYOUT_PCM, strip_type, 0)                              \
+    KERNEL_ENTRY(pcm_##name##_inv, ENCODE_LAYOUT_PCM, strip_type, 1)                        \
+    KERNEL_ENTRY(spi_##name, ENCODE_LAYOUT_SPI, strip_type, 0)                              \
+    KERNEL_ENTRY(spi_##name##_inv, ENCODE_LAYOUT_SPI, strip_type, 1)
+
+static const encode_kernel_t kernels[] =
+{
+    STRIP_TYPES(KERNEL_ENTRIES)
+};
+
+// Strip type 0 marks the kernels taking the strip type as an argument
+static const encode_kernel_t custom_kernels[] =
+{
+    KERNEL_ENTRY(pwm_custom, ENCODE_LAYOUT_PWM, 0, 0)
+    KERNEL_ENTRY(pcm_custom, ENCODE_LAYOUT_PCM, 0, 0)
+    KERNEL_ENTRY(pcm_custom_inv, ENCODE_LAYOUT_PCM, 0, 1)
+    KERNEL_ENTRY(spi_custom, ENCODE_LAYOUT_SPI, 0, 0)
+    KERNEL_ENTRY(spi_custom_inv, ENCODE_LAYOUT_SPI, 0, 1)
+};
+
+/**
+ * Find the kernel for a layout, strip type and invert setting.  Strip types
+ * other than the predefined ones get the kernel reading the shifts at runtime.
+ *
+ * @param    layout      One of the ENCODE_LAYOUT_xxx constants.
+ * @param    strip_type  Strip colour layout, one of the WS2811_STRIP_xxx or SK6812_STRIP_xxx constants.
+ * @param    invert      Non-zero if the output is inverted.  Ignored for PWM.
+ *
+ * @returns  Kernel, never NULL.
+ */
+const encode_kernel_t *encode_get_kernel(int layout, uint32_t strip_type, int invert)
+{
+    unsigned int i;
+
+    if (layout == ENCODE_LAYOUT_PWM)
+    {
+        invert = 0;
+    }
+
+    for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++)
+    {
+        if ((kernels[i].layout == layout) && (kernels[i].strip_type == strip_type) &&
+            (kernels[i].invert == !!invert))
+        {
+            return &kernels[i];
+        }
+    }
+
+    for (i = 0; i < sizeof(custom_kernels) / sizeof(custom_kernels[0]); i++)
+    {
+        if ((custom_kernels[i].layout == layout) && (custom_kernels[i].invert == !!invert))
+        {
+            break;
+        }
+    }
+
+    return &custom_kernels[i];
+}
+
+/**
+ * List all specialized kernels, for benchmarking.  The custom kernels aren't
+ * included, they need a strip type.
+ *
+ * @param    count  Set to the number of kernels.
+ *
+ * @returns  Array of kernels.
+ */
+const encode_kernel_t *encode_kernels(int *count)
+{
+    *count = sizeof(kernels) / sizeof(kernels[0]);
+
+    return kernels;
+}
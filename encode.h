@@ -0,0 +1,107 @@
+/*
+ * encode.h
+ *
+ * Copyright (c) 2014 Jeremy Garff <jer @ jers.net>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef __ENCODE_H__
+#define __ENCODE_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/*
+ * Symbol encoder
+ *
+ * Every colour bit is sent as 3 symbols (1 -> 110, 0 -> 100), so each colour
+ * byte expands into 3 wire bytes.  The expanders below take an array of colour
+ * bytes and write the resulting wire bytes in transmission order, which is the
+ * SPI byte order.  PWM and PCM shift out 32-bit words MSB first, so the LED
+ * kernels below byte swap whole words for those layouts.
+ */
+
+#define ENCODE_BYTES_PER_COLOUR                  3
+
+#define ENCODE_IMPL_TABLE                        0   // Reference convert_table lookup, byte at a time
+#define ENCODE_IMPL_SWAR                         1   // Portable 24-bit table, 4 colours per 3 words
+#define ENCODE_IMPL_NEON                         2   // ARM NEON, 8 colours per iteration
+#define ENCODE_IMPL_SSSE3                        3   // x86 SSSE3, 16 colours per iteration
+#define ENCODE_IMPL_AVX2                         4   // x86 AVX2, 32 colours per iteration
+#define ENCODE_IMPL_COUNT                        5
+
+typedef void (*encode_fn_t)(uint8_t *dst, const uint8_t *src, int count);
+
+encode_fn_t encode_get_impl(int impl);                                          //< Expander for impl, NULL if not supported on this CPU
+int encode_best_impl(void);                                                     //< Fastest expander supported on this CPU
+const char *encode_impl_name(int impl);                                         //< Human readable expander name
+
+void encode_symbols(uint8_t *dst, const uint8_t *src, int count);               //< Expand count colour bytes using the best expander
+
+void encode_interleave_words(volatile uint32_t *dst, const uint32_t *a, int a_words,
+                             const uint32_t *b, int b_words, int words);        //< Store two channels as word pairs (PWM)
+
+/*
+ * LED kernels
+ *
+ * A kernel takes LED values through a brightness and gamma table, expands them
+ * and stores the result in one of the DMA buffer layouts.  There is one kernel
+ * per layout, strip type and invert setting, so none of those are checked while
+ * encoding.  Custom strip types use a kernel per layout and invert setting that
+ * reads the shifts from the strip type argument.
+ */
+
+#define ENCODE_LAYOUT_PWM                        0   // MSB first words, interleaved with the other channel
+#define ENCODE_LAYOUT_PCM                        1   // MSB first words
+#define ENCODE_LAYOUT_SPI                        2   // Bytes in transmission order
+
+// Encode count LEDs starting at leds[first], which must be a multiple of 4.  pxl
+// points to the start of the buffer, or of the channel's first word for PWM.
+// custom is the strip type, only read by the custom kernels.
+typedef void (*encode_kernel_fn_t)(volatile uint8_t *pxl, const uint32_t *leds,
+                                   const uint8_t *lut, int first, int count,
+                                   uint32_t custom);
+
+typedef struct
+{
+    encode_kernel_fn_t fn;                       //< Kernel function
+    const char *name;                            //< Human readable kernel name
+    int layout;                                  //< One of the ENCODE_LAYOUT_xxx constants
+    uint32_t strip_type;                         //< Strip color layout the kernel was built for, 0 if custom
+    int invert;                                  //< Output is inverted
+} encode_kernel_t;
+
+const encode_kernel_t *encode_get_kernel(int layout, uint32_t strip_type,
+                                         int invert);                           //< Kernel for the layout, strip type and invert
+const encode_kernel_t *encode_kernels(int *count);                              //< All specialized kernels
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __ENCODE_H__ */
@@ -51,6 +51,7 @@ static char VERSION[] = "XX.YY.ZZ";
 #include "version.h"
 
 #include "ws2811.h"
+#include "encode.h"
 #include "animations.h"
 
 #include <time.h>
@@ -81,6 +82,7 @@ int height = HEIGHT;
 int led_count = LED_COUNT;
 
 int clear_on_exit = 0;
+int bench_frames = 0;
 
 ws2811_t ledstring =
 {
@@ -104,6 +106,7 @@ ws2811_t ledstring =
             .brightness = 0,
         },
     },
+    .skip_unchanged = 1,
 };
 
 ws2811_led_t *matrix;
@@ -203,6 +206,114 @@ static void ctrl_c_handler(int signum)
     running = 0;
 }
 
+// SPI and captures don't start a DMA channel, so there is no DMA start time to report
+static int uses_dma(ws2811_t *ws2811)
+{
+    return !ws2811->capture.enabled && (ws2811->channel[0].gpionum != 10);
+}
+
+static uint64_t bench_time_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+static void run_kernel_bench(int count, int frames)
+{
+    const encode_kernel_t *kernels;
+    ws2811_led_t *leds;
+    uint8_t lut[256];
+    uint8_t *buf;
+    int num_kernels, k, frame, i;
+
+    // Large enough for RGBW with PWM interleaving, rounded up to whole words
+    leds = malloc(count * sizeof(ws2811_led_t));
+    buf = malloc((((count * 4 * 3) + 3) & ~3) * 2);
+    if (!leds || !buf)
+    {
+        free(leds);
+        free(buf);
+        return;
+    }
+
+    for (i = 0; i < 256; i++)
+    {
+        lut[i] = i;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        leds[i] = (i * 0x10203040) ^ 0x5a5a5a5a;
+    }
+
+    kernels = encode_kernels(&num_kernels);
+    for (k = 0; (k < num_kernels) && running; k++)
+    {
+        uint64_t start = bench_time_us();
+
+        for (frame = 0; frame < frames; frame++)
+        {
+            kernels[k].fn(buf, leds, lut, 0, count, kernels[k].strip_type);
+        }
+
+        printf("kernel %-12s %d LEDs: %.1f us/frame\n", kernels[k].name, count,
+               (double)(bench_time_us() - start) / frames);
+    }
+
+    free(leds);
+    free(buf);
+}
+
+/*
+ * Render the same sequence of frames through the cached staging buffer and
+ * directly into the uncached DMA buffer, and report the per-frame cost of each.
+ */
+static void run_bench(ws2811_t *ws2811, int frames)
+{
+    ws2811_channel_t *channel = &ws2811->channel[0];
+    int direct, frame, i;
+
+    for (direct = 0; direct <= 1; direct++)
+    {
+        ws2811->render_direct = direct;
+        memset(&ws2811->stats, 0, sizeof(ws2811->stats));
+
+        for (frame = 0; (frame < frames) && running; frame++)
+        {
+            for (i = 0; i < channel->count; i++)
+            {
+                channel->leds[i] = ((frame * 0x030201) + (i * 0x102030)) & 0x00ffffff;
+            }
+
+            if (ws2811_render(ws2811) != WS2811_SUCCESS)
+            {
+                break;
+            }
+        }
+
+        if (ws2811->stats.frames)
+        {
+            printf("%-6s %d LEDs, %llu frames: encode %.1f us/frame, copy %.1f us/frame, ",
+                   direct ? "direct" : "staged", channel->count,
+                   (unsigned long long)ws2811->stats.frames,
+                   (double)ws2811->stats.encode_us / ws2811->stats.frames,
+                   (double)ws2811->stats.copy_us / ws2811->stats.frames);
+            if (uses_dma(ws2811))
+            {
+                printf("DMA start %.1f us/frame, ", (double)ws2811->stats.kick_us / ws2811->stats.frames);
+            }
+            printf("%llu LEDs skipped\n", (unsigned long long)ws2811->stats.leds_skipped);
+        }
+    }
+
+    ws2811->render_direct = 0;
+
+    run_kernel_bench(channel->count, frames);
+}
+
 static void setup_handlers(void)
 {
     struct sigaction sa =
@@ -229,6 +340,13 @@ void parseargs(int argc, char **argv, ws2811_t *ws2811)
 		{"invert", no_argument, 0, 'i'},
 		{"clear", no_argument, 0, 'c'},
 		{"strip", required_argument, 0, 's'},
+		{"count", required_argument, 0, 'n'},
+		{"bench", required_argument, 0, 'b'},
+		{"threads", required_argument, 0, 't'},
+		{"cache", required_argument, 0, 'k'},
+		{"keepalive", required_argument, 0, 'a'},
+		{"capture", required_argument, 0, 'o'},
+		{"preview", required_argument, 0, 'p'},
 		/* {"height", required_argument, 0, 'y'}, */
 		/* {"width", required_argument, 0, 'x'}, */
 		{"version", no_argument, 0, 'v'},
@@ -239,7 +357,7 @@ void parseargs(int argc, char **argv, ws2811_t *ws2811)
 	{
 
 		index = 0;
-		c = getopt_long(argc, argv, "cd:g:his:vx:y:", longopts, &index);
+		c = getopt_long(argc, argv, "a:b:cd:g:hik:n:o:p:s:t:vx:y:", longopts, &index);
 
 		if (c == -1)
 			break;
@@ -262,8 +380,15 @@ void parseargs(int argc, char **argv, ws2811_t *ws2811)
 				"                 If omitted, default is 18 (PWM0)\n"
 				"-i (--invert)  - invert pin output (pulse LOW)\n"
 				"-c (--clear)   - clear matrix on exit.\n"
+				"-n (--count)   - number of LEDs (default %d)\n"
+				"-b (--bench)   - time N frames staged, direct and per kernel, then exit\n"
+				"-t (--threads) - encoder threads for long strips (default 1)\n"
+				"-k (--cache)   - keep N encoded frames and replay them (default 0)\n"
+				"-a (--keepalive) - resend an unchanged frame every N ms (default 0, never)\n"
+				"-o (--capture) - write the wire stream to FILE instead of driving the LEDs\n"
+				"-p (--preview) - show the LEDs in the terminal, at most N times a second\n"
 				"-v (--version) - version information\n"
-				, argv[0]);
+				, argv[0], LUT_H * LUT_W);
 			exit(-1);
 
 		case 'D':
@@ -298,6 +423,55 @@ void parseargs(int argc, char **argv, ws2811_t *ws2811)
 			clear_on_exit=1;
 			break;
 
+		case 'n':
+			if (optarg) {
+				int count = atoi(optarg);
+				if (count > 0) {
+					ws2811->channel[0].count = count;
+				} else {
+					printf ("invalid count %d\n", count);
+					exit (-1);
+				}
+			}
+			break;
+
+		case 'b':
+			if (optarg) {
+				bench_frames = atoi(optarg);
+			}
+			break;
+
+		case 't':
+			if (optarg) {
+				ws2811->encode_threads = atoi(optarg);
+			}
+			break;
+
+		case 'k':
+			if (optarg) {
+				ws2811->frame_cache_size = atoi(optarg);
+			}
+			break;
+
+		case 'o':
+			if (optarg) {
+				ws2811->capture.enabled = 1;
+				ws2811->capture.file = optarg;
+			}
+			break;
+
+		case 'a':
+			if (optarg) {
+				ws2811->keepalive_us = atoi(optarg) * 1000;
+			}
+			break;
+
+		case 'p':
+			if (optarg) {
+				enable_preview(atoi(optarg));
+			}
+			break;
+
 		case 'd':
 			if (optarg) {
 				int dma = atoi(optarg);
@@ -402,26 +576,38 @@ int main(int argc, char *argv[])
         fprintf(stderr, "ws2811_init failed: %s\n", ws2811_get_return_t_str(ret));
         return ret;
     }
+
+    if (bench_frames > 0)
+    {
+        run_bench(&ledstring, bench_frames);
+        ws2811_fini(&ledstring);
+        return 0;
+    }
+
     // Create ellipse frames
 
     int num_frames = 50*10;
 
     AnimationContext current_animation = {
-      .frames = NULL,
+      .pixels = NULL,
       .frame_count = 0,
       .current_frame = 0,
-      .direction = 1
+      .direction = 1,
+      .led_count = LUT_LED_COUNT
     };
 
     AnimationContext next_animation = {
-      .frames = NULL,
+      .pixels = NULL,
       .frame_count = 0,
       .current_frame = 0,
-      .direction = 1
+      .direction = 1,
+      .led_count = LUT_LED_COUNT
     };
 
 
     int direction = 1;
+    // Part of the cached frame ids, bumped whenever the frames are replaced
+    uint32_t animation_generation = 0;
 
     enum AnimationType current_animation_type = GROWING_ELLIPSE;
     enum AnimationType next_animation_type = ROTATING_FRAMES;  // Start with this animation
@@ -434,8 +620,30 @@ int main(int argc, char *argv[])
         gettimeofday(&current_time, NULL);
         elapsed_seconds = current_time.tv_sec - start_time.tv_sec;
 
-        send_frame_to_neopixels(current_animation.frames[current_animation.current_frame], &ledstring);
-        if ((ret = ws2811_render(&ledstring)) != WS2811_SUCCESS)
+        if (ledstring.frame_cache_size > 0)
+        {
+            uint64_t frame_id = ((uint64_t)animation_generation << 32) | current_animation.current_frame;
+
+            // Frames are only converted and encoded the first time round
+            ret = ws2811_render_cached(&ledstring, frame_id);
+            if (ret == WS2811_ERROR_NOT_CACHED)
+            {
+                copy_animation_frame_to_leds(&current_animation, current_animation.current_frame, &ledstring);
+                ret = ws2811_render_store(&ledstring, frame_id);
+            }
+
+            if (ret == WS2811_SUCCESS)
+            {
+                preview_animation_frame(&current_animation, current_animation.current_frame, &ledstring);
+            }
+        }
+        else
+        {
+            ret = send_animation_frame_to_neopixels(&current_animation, current_animation.current_frame,
+                                                    &ledstring);
+        }
+
+        if (ret != WS2811_SUCCESS)
         {
             fprintf(stderr, "ws2811_render failed: %s\n", ws2811_get_return_t_str(ret));
             break;
@@ -457,6 +665,7 @@ int main(int argc, char *argv[])
 
           if (next_animation_type != current_animation_type) {
             clear_animation(&current_animation);
+            animation_generation++;
             switch (next_animation_type) {
                 case GROWING_ELLIPSE:
                     make_growing_ellipse(&current_animation, num_frames);
@@ -484,6 +693,23 @@ int main(int argc, char *argv[])
 	ws2811_render(&ledstring);
     }
 
+    printf("frames: %llu sent, %llu skipped as unchanged\n",
+           (unsigned long long)ledstring.stats.frames,
+           (unsigned long long)ledstring.stats.frames_skipped);
+    if (ledstring.stats.frames && uses_dma(&ledstring))
+    {
+        printf("DMA start: %.1f us/frame, %llu channel resets\n",
+               (double)ledstring.stats.kick_us / ledstring.stats.frames,
+               (unsigned long long)ledstring.stats.dma_resets);
+    }
+
+    if (ledstring.frame_cache_size > 0)
+    {
+        printf("frame cache: %llu hits, %llu misses\n",
+               (unsigned long long)ledstring.stats.cache_hits,
+               (unsigned long long)ledstring.stats.cache_misses);
+    }
+
     ws2811_fini(&ledstring);
 
     printf ("\n");
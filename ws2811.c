@@ -30,18 +30,21 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/timerfd.h>
 #include <sys/mman.h>
 #include <signal.h>
 #include <linux/types.h>
 #include <linux/spi/spidev.h>
 #include <time.h>
 #include <math.h>
+#include <pthread.h>
 #include "mailbox.h"
 #include "clk.h"
 #include "gpio.h"
@@ -49,6 +52,7 @@
 #include "pwm.h"
 #include "pcm.h"
 #include "rpihw.h"
+#include "encode.h"
 
 #include "ws2811.h"
 
@@ -58,25 +62,59 @@
 #define OSC_FREQ                                 19200000   // crystal frequency
 #define OSC_FREQ_PI4                             54000000   // Pi 4 crystal frequency
 
-/* 4 colors (R, G, B + W), 8 bits per byte, 3 symbols per bit + 55uS low for reset signal */
-#define LED_COLOURS                              4
-#define LED_RESET_uS                             55
-#define LED_BIT_COUNT(leds, freq)                ((leds * LED_COLOURS * 8 * 3) + ((LED_RESET_uS * \
-                                                  (freq * 3)) / 1000000))
+/* 3 or 4 colors (R, G, B + W), 8 bits per byte, 3 symbols per bit + 55uS low for reset signal */
+#define LED_RESET_uS                             WS2811_RESET_US
+#define LED_BIT_COUNT(leds, colours)             (leds * colours * 8 * 3)
+#define LED_RESET_BIT_COUNT(freq)                ((LED_RESET_uS * (freq * 3)) / 1000000)
+
+/* Number of DMA buffers, one is transmitted while the next frame is rendered into the other. */
+#define DMA_BUFFERS                              2
 
 /* Minimum time to wait for reset to occur in microseconds. */
 #define LED_RESET_WAIT_TIME                      300
 
-// Pad out to the nearest uint32 + 32-bits for idle low/high times the number of channels
-#define PWM_BYTE_COUNT(leds, freq)               (((((LED_BIT_COUNT(leds, freq) >> 3) & ~0x7) + 4) + 4) * \
-                                                  RPI_PWM_CHANNELS)
-#define PCM_BYTE_COUNT(leds, freq)               ((((LED_BIT_COUNT(leds, freq) >> 3) & ~0x7) + 4) + 4)
+// LED data of one channel padded out to the nearest uint32
+#define LED_BYTE_COUNT(leds, colours)            (((LED_BIT_COUNT(leds, colours) + 31) / 32) * 4)
+// Reset time padded out to the nearest uint32 + 32-bits for idle low/high times
+#define RESET_BYTE_COUNT(freq)                   ((((LED_RESET_BIT_COUNT(freq) + 31) / 32) * 4) + 4)
+
+// The DMA buffers only hold LED data of the longest channel, the reset time is sent from a
+// shared zero word
+#define PWM_BYTE_COUNT(chan_bytes)               (chan_bytes * RPI_PWM_CHANNELS)
+#define PWM_RESET_BYTE_COUNT(freq)               (RESET_BYTE_COUNT(freq) * RPI_PWM_CHANNELS)
+#define PCM_BYTE_COUNT(chan_bytes)               (chan_bytes)
+#define PCM_RESET_BYTE_COUNT(freq)               RESET_BYTE_COUNT(freq)
+// SPI doesn't use DMA, so the reset time is part of its buffer
+#define SPI_BYTE_COUNT(chan_bytes, freq)         (chan_bytes + RESET_BYTE_COUNT(freq))
+
+/* Zeroed block after the control blocks, the reset time is sent from its first word */
+#define DMA_ZERO_BYTES                           32
+
+/* Control blocks per buffer for frames sent by ws2811_render_runs() */
+#define DMA_RUN_CBS                              64
+/* LEDs per repeated pattern, 4 so both 3 and 4 colour patterns are whole words */
+#define RUN_GROUP_LEDS                           4
+
+/* ws2811_wait() sleeps until this long before the DMA transfer should be done, then polls. */
+#define DMA_WAIT_MARGIN_US                       200
+
+// LEDs encoded per pass of the render loop.  Must be a multiple of 4 so every chunk
+// starts on a word boundary for both 3 and 4 colour strips.
+#define RENDER_CHUNK_LEDS                        64
+
+// Words per channel encoded at a time when both PWM channels are encoded together,
+// a whole number of both RGB (64) and RGBW (48) LEDs.
+#define PAIR_BLOCK_WORDS                         144
+
+// Encoder threads are only woken for frames with at least this many LEDs
+#define THREAD_MIN_LEDS                          512
+#define ENCODE_MAX_THREADS                       8
 
 // Driver mode definitions
 #define NONE	0
-#define PWM	1
-#define PCM	2
-#define SPI	3
+#define PWM	WS2811_LAYOUT_PWM
+#define PCM	WS2811_LAYOUT_PCM
+#define SPI	WS2811_LAYOUT_SPI
 
 // We use the mailbox interface to request memory from the VideoCore.
 // This lets us request one physically contiguous chunk, find its
@@ -91,20 +129,180 @@ typedef struct videocore_mbox {
     uint8_t *virt_addr;     /* From mapmem() */
 } videocore_mbox_t;
 
+// Brightness and gamma correction folded into one table per channel.  The inputs
+// it was built from are kept so changes made through the public channel fields,
+// or by ws2811_set_custom_gamma_factor(), are picked up on the next render.
+typedef struct channel_lut {
+    int valid;              /* Table has been built */
+    unsigned int generation;                    /* Bumped every time the table is rebuilt */
+    uint8_t brightness;     /* Brightness the table was built with */
+    uint8_t gamma[256];     /* Gamma table the table was built from */
+    uint8_t lut[256];       /* gamma[(value * (brightness + 1)) >> 8] */
+} channel_lut_t;
+
+// LED values last encoded into the render buffer, used to find the LEDs that changed
+// since the previous frame so only those get encoded again.
+typedef struct channel_shadow {
+    ws2811_led_t *leds;
+    int valid;              /* leds and invert describe the render buffer contents */
+    int invert;             /* Output inversion the render buffer was encoded with */
+    unsigned int generation;                    /* Table generation of the frame ws2811_render() last sent */
+} channel_shadow_t;
+
+// Frame encoded by ws2811_submit(), waiting to be sent
+typedef struct frame_slot {
+    uint8_t *buf;           /* Encoded frame, laid out like the DMA buffer */
+    int span_lo;            /* Buffer words holding LED data */
+    int span_hi;
+    uint64_t present_at_us; /* CLOCK_MONOTONIC time to start sending, 0 for right away */
+    uint32_t protocol_time;
+} frame_slot_t;
+
+// Ring of encoded frames, sent by the queue thread.  Filled by a single producer.
+typedef struct frame_queue {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;    /* Frame queued or stopping, CLOCK_MONOTONIC for timed waits */
+    pthread_cond_t space;   /* Slot freed */
+    frame_slot_t *slots;
+    int depth;
+    int head;               /* Oldest queued frame */
+    int count;              /* Frames queued */
+    int stop;
+} frame_queue_t;
+
+// One frame worth of encoding, split into parts that can run on different threads
+typedef struct encode_job {
+    const ws2811_led_t *leds[RPI_PWM_CHANNELS]; /* LED values to encode per channel */
+    const uint8_t *lut[RPI_PWM_CHANNELS];
+    volatile uint8_t *pxl;  /* Render buffer, laid out like the DMA buffer */
+    int incremental;        /* Render buffer keeps its contents between frames */
+    int paired;             /* Both PWM channels are encoded together */
+    int full[RPI_PWM_CHANNELS];                 /* Encode without comparing to the shadow copy */
+    int parts;
+} encode_job_t;
+
+// What one part of a job encoded
+typedef struct encode_result {
+    int span_lo;            /* Buffer words written */
+    int span_hi;
+    int encoded[RPI_PWM_CHANNELS];              /* LEDs encoded per channel */
+} encode_result_t;
+
+struct encode_pool;
+
+typedef struct encode_worker {
+    struct encode_pool *pool;
+    pthread_t thread;
+    int part;
+} encode_worker_t;
+
+// Persistent encoder threads.  The rendering thread encodes part 0 itself.
+typedef struct encode_pool {
+    ws2811_t *ws2811;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    unsigned int generation;                    /* Bumped for every job */
+    int busy;               /* Workers still encoding the current job */
+    int stop;
+    int count;              /* Worker threads running */
+    encode_worker_t workers[ENCODE_MAX_THREADS];
+    encode_job_t job;
+    encode_result_t results[ENCODE_MAX_THREADS + 1];
+} encode_pool_t;
+
+// Frames encoded once into DMA memory of their own, with the control blocks of each
+// frame linked to the next one and the last frame linked back to the first.
+typedef struct frame_loop {
+    videocore_mbox_t mbox;
+    int frames;
+    int frame_cbs;          /* Control blocks per frame, LED data followed by the gap */
+    uint64_t frame_us;      /* Time to send one frame including the gap */
+} frame_loop_t;
+
+// Frame encoded by ws2811_render_store(), with what it was encoded with
+typedef struct frame_cache_entry {
+    uint64_t frame_id;
+    uint64_t last_used;     /* Cache use count when last sent, 0 if the entry is empty */
+    unsigned int generation[RPI_PWM_CHANNELS];  /* Brightness and gamma table generations */
+    int invert[RPI_PWM_CHANNELS];
+    uint8_t *buf;           /* Encoded frame, laid out like the DMA buffer */
+} frame_cache_entry_t;
+
+// Encoded frames, the least recently used one is replaced when full
+typedef struct frame_cache {
+    int size;
+    uint64_t uses;
+    frame_cache_entry_t *entries;
+} frame_cache_t;
+
+// How frames reach the LEDs.  There is one per driver mode, and a capture backend per
+// driver mode that keeps the wire stream instead of sending it.
+typedef struct ws2811_backend {
+    int driver_mode;        /* PWM, PCM or SPI, the wire format frames are encoded in */
+    int layout;             /* ENCODE_LAYOUT_xxx of the driver mode */
+    int dma;                /* Frames are sent from the DMA buffers, which take turns */
+    ws2811_return_t (*init)(ws2811_t *ws2811);      /* Allocate pxl_raw and set up the hardware */
+    ws2811_return_t (*start)(ws2811_t *ws2811);     /* Start sending pxl_raw */
+    ws2811_return_t (*wait)(ws2811_t *ws2811);      /* Wait for the frame being sent */
+    void (*fini)(ws2811_t *ws2811);                 /* Stop the hardware */
+} ws2811_backend_t;
+
 typedef struct ws2811_device
 {
     int driver_mode;
-    volatile uint8_t *pxl_raw;
+    const ws2811_backend_t *backend;
+    volatile uint8_t *pxl_raw;                  /* Idle DMA buffer the next frame is rendered into */
+    volatile uint8_t *pxl_buf[DMA_BUFFERS];
+    uint8_t *pxl_stage;     /* Cached copy of pxl_raw the encoder writes into */
     volatile dma_t *dma;
     volatile pwm_t *pwm;
     volatile pcm_t *pcm;
     int spi_fd;
-    volatile dma_cb_t *dma_cb;
+    uint8_t spi_mode;       /* Mode and word size read back from spidev */
+    uint8_t spi_bits;
+    uint8_t *capture_buf;   /* pxl_raw of the capture backend */
+    int capture_fd;         /* File frames are captured to, 0 if none */
+    int simulated;          /* Captured frames follow a simulated clock instead of being paced */
+    volatile dma_cb_t *dma_cb;                  /* Control block transmitting pxl_raw */
     uint32_t dma_cb_addr;
+    volatile dma_cb_t *dma_cb_buf[DMA_BUFFERS];     /* First control block of each buffer's chain */
+    uint32_t dma_cb_buf_addr[DMA_BUFFERS];
+    volatile dma_cb_t *dma_cb_reset;            /* Control blocks sending the reset time, shared by the chains */
+    volatile dma_cb_t *dma_cb_run[DMA_BUFFERS];     /* Control blocks sending a frame rendered as runs */
+    int dma_run_cb_count;   /* Run control blocks per buffer, 0 without 2D mode */
+    volatile uint32_t *dma_zero;                /* Zero word the reset time is sent from */
+    int dma_cb_count;       /* Control blocks per buffer */
+    int dma_reset_cb_count;
+    uint32_t dma_max_txfr;  /* Transfer limit of one control block on the selected channel */
+    uint32_t dma_ti;        /* Transfer information of the control blocks, without source increment */
+    uint32_t dma_dest_ad;   /* Bus address of the peripheral FIFO */
+    int dma_reset_done;     /* The channel went through the full reset since init */
+    int dma_bytes;          /* Bytes sent per frame, LED data plus reset time */
+    int buf_index;          /* Index of pxl_raw in pxl_buf */
+    channel_lut_t lut[RPI_PWM_CHANNELS];
+    channel_shadow_t shadow[RPI_PWM_CHANNELS];
+    const encode_kernel_t *kernel[RPI_PWM_CHANNELS][2];    /* Specialized kernel per channel, not inverted/inverted */
+    const encode_kernel_t *pair_kernel[RPI_PWM_CHANNELS];  /* Unstrided word kernel for encoding PWM channels together */
+    int pending_lo[DMA_BUFFERS];                /* Word range of pxl_stage not yet copied to each buffer */
+    int pending_hi[DMA_BUFFERS];
+    encode_pool_t *pool;    /* Encoder threads, NULL to encode in the rendering thread */
+    frame_queue_t *queue;   /* Frames submitted with ws2811_submit(), NULL if not enabled */
+    frame_loop_t *loop;     /* Frames looped by the DMA engine, NULL if not running */
+    frame_cache_t *cache;   /* Encoded frames, NULL until ws2811_render_store() is used */
     volatile gpio_t *gpio;
     volatile cm_clk_t *cm_clk;
     videocore_mbox_t mbox;
     int max_count;
+    int chan_bytes;         /* Encoded LED data of the longest channel in bytes */
+    int pxl_size;           /* Size of the pxl_raw buffer in bytes */
+    uint64_t dma_time_us;   /* Time to transmit a whole frame, including the reset time */
+    uint64_t dma_done_us;   /* When the running DMA transfer should be done */
+    uint64_t previous_timestamp;                /* When the last frame was started */
+    int sent_valid;         /* The shadow copies hold the frame ws2811_render() last sent */
+    uint64_t ready_us;      /* When the next frame can be sent */
+    int completion_fd;      /* timerfd expiring at ready_us, 0 if not created yet */
 } ws2811_device_t;
 
 /**
@@ -123,6 +321,19 @@ static uint64_t get_microsecond_timestamp()
     return (uint64_t) t.tv_sec * 1000000 + t.tv_nsec / 1000;
 }
 
+/**
+ * Number of colours sent per LED.
+ *
+ * @param    channel  Channel pointer.
+ *
+ * @returns  4 for strips with a white component, 3 otherwise.
+ */
+static int channel_colours(ws2811_channel_t *channel)
+{
+    // If our shift mask includes the highest nibble, then we have 4 LEDs, RBGW.
+    return (channel->strip_type & SK6812_SHIFT_WMASK) ? 4 : 3;
+}
+
 /**
  * Iterate through the channels and find the largest led count.
  *
@@ -145,6 +356,32 @@ static int max_channel_led_count(ws2811_t *ws2811)
     return max;
 }
 
+/**
+ * Iterate through the channels and find the longest encoded LED data, which depends on
+ * both the LED count and the number of colours of the strip type.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  Maximum number of bytes of LED data in all channels, a word multiple.
+ */
+static int max_channel_byte_count(ws2811_t *ws2811)
+{
+    int chan, max = 0;
+
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        ws2811_channel_t *channel = &ws2811->channel[chan];
+        int bytes = LED_BYTE_COUNT(channel->count, channel_colours(channel));
+
+        if (bytes > max)
+        {
+            max = bytes;
+        }
+    }
+
+    return max;
+}
+
 /**
  * Map all devices into userspace memory.
  * Not called for SPI
@@ -274,6 +511,160 @@ static uint32_t addr_to_bus(ws2811_device_t *device, const volatile void *virt)
     return mbox->bus_addr + offset;
 }
 
+/**
+ * Allocate, lock and map uncached memory from the VideoCore for DMA.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ * @param    mbox    Allocation to fill in, size set to the bytes needed.
+ *
+ * @returns  0 on success, value from ws2811_return_t enum otherwise.  mbox->handle is
+ *           -1 on failure.
+ */
+static ws2811_return_t dma_mem_alloc(ws2811_t *ws2811, videocore_mbox_t *mbox)
+{
+    // Round up to page size multiple
+    mbox->size = (mbox->size + (PAGE_SIZE - 1)) & ~(PAGE_SIZE - 1);
+
+    mbox->handle = mbox_open();
+    if (mbox->handle == -1)
+    {
+        return WS2811_ERROR_MAILBOX_DEVICE;
+    }
+
+    mbox->mem_ref = mem_alloc(mbox->handle, mbox->size, PAGE_SIZE,
+                              ws2811->rpi_hw->videocore_base == 0x40000000 ? 0xC : 0x4);
+    if (mbox->mem_ref == 0)
+    {
+        mbox_close(mbox->handle);
+        mbox->handle = -1;
+        return WS2811_ERROR_OUT_OF_MEMORY;
+    }
+
+    mbox->bus_addr = mem_lock(mbox->handle, mbox->mem_ref);
+    if (mbox->bus_addr == (uint32_t) ~0UL)
+    {
+        mem_free(mbox->handle, mbox->mem_ref);
+        mbox_close(mbox->handle);
+        mbox->handle = -1;
+        return WS2811_ERROR_MEM_LOCK;
+    }
+
+    mbox->virt_addr = mapmem(BUS_TO_PHYS(mbox->bus_addr), mbox->size, DEV_MEM);
+    if (!mbox->virt_addr)
+    {
+        mem_unlock(mbox->handle, mbox->mem_ref);
+        mem_free(mbox->handle, mbox->mem_ref);
+        mbox_close(mbox->handle);
+        mbox->handle = -1;
+        return WS2811_ERROR_MMAP;
+    }
+
+    return WS2811_SUCCESS;
+}
+
+/**
+ * Release memory allocated by dma_mem_alloc().
+ *
+ * @param    mbox  Allocation to release.
+ *
+ * @returns  None
+ */
+static void dma_mem_free(videocore_mbox_t *mbox)
+{
+    if (mbox->handle == -1)
+    {
+        return;
+    }
+
+    unmapmem(mbox->virt_addr, mbox->size);
+    mem_unlock(mbox->handle, mbox->mem_ref);
+    mem_free(mbox->handle, mbox->mem_ref);
+    mbox_close(mbox->handle);
+
+    mbox->handle = -1;
+}
+
+/**
+ * Make one of the DMA buffers the target for the next rendered frame.
+ *
+ * @param    device  Device pointer.
+ * @param    index   Buffer index.
+ *
+ * @returns  None
+ */
+static void select_dma_buffer(ws2811_device_t *device, int index)
+{
+    device->buf_index = index;
+    device->pxl_raw = device->pxl_buf[index];
+    device->dma_cb = device->dma_cb_buf[index];
+    device->dma_cb_addr = device->dma_cb_buf_addr[index];
+}
+
+/**
+ * Fill a chain of DMA control blocks sending a block of memory to the peripheral, in
+ * pieces no larger than the selected channel can transfer with one control block.
+ *
+ * @param    device     Device pointer.
+ * @param    dma_cb     First control block of the chain.
+ * @param    dma_cb_ad  Bus address of dma_cb.
+ * @param    source_ad  Bus address of the data.
+ * @param    inc        Non-zero to step through the data, 0 to send the same word repeatedly.
+ * @param    bytes      Number of bytes to send.
+ * @param    next_ad    Bus address of the control block to link the last one to, 0 to stop.
+ *
+ * @returns  Number of control blocks used.
+ */
+static int build_dma_chain(ws2811_device_t *device, volatile dma_cb_t *dma_cb, uint32_t dma_cb_ad,
+                           uint32_t source_ad, int inc, int bytes, uint32_t next_ad)
+{
+    const int max = device->dma_max_txfr;
+    const int count = (bytes + max - 1) / max;
+    int i;
+
+    for (i = 0; i < count; i++)
+    {
+        const int offset = i * max;
+
+        dma_cb[i].ti = device->dma_ti | (inc ? RPI_DMA_TI_SRC_INC : 0);
+        dma_cb[i].source_ad = source_ad + (inc ? offset : 0);
+        dma_cb[i].dest_ad = device->dma_dest_ad;
+        dma_cb[i].txfr_len = bytes - offset < max ? bytes - offset : max;
+        dma_cb[i].stride = 0;
+        dma_cb[i].nextconbk = i + 1 < count ? dma_cb_ad + ((i + 1) * sizeof(dma_cb_t)) : next_ad;
+    }
+
+    return count;
+}
+
+/**
+ * Build the DMA control block chain of every buffer.  A chain sends its buffer, then
+ * links to the reset control blocks.  Those are shared by all chains and send the
+ * reset time by reading the same zero word over and over.
+ *
+ * @param    device   Device pointer.
+ * @param    ti       Transfer information, without source increment.
+ * @param    dest_ad  Bus address of the peripheral FIFO.
+ *
+ * @returns  None
+ */
+static void setup_dma_chains(ws2811_device_t *device, uint32_t ti, uint32_t dest_ad)
+{
+    uint32_t reset_ad = addr_to_bus(device, device->dma_cb_reset);
+    int buf;
+
+    device->dma_ti = ti;
+    device->dma_dest_ad = dest_ad;
+
+    for (buf = 0; buf < DMA_BUFFERS; buf++)
+    {
+        build_dma_chain(device, device->dma_cb_buf[buf], device->dma_cb_buf_addr[buf],
+                        addr_to_bus(device, device->pxl_buf[buf]), 1, device->pxl_size, reset_ad);
+    }
+
+    build_dma_chain(device, device->dma_cb_reset, reset_ad, addr_to_bus(device, device->dma_zero), 0,
+                    device->dma_bytes - device->pxl_size, 0);
+}
+
 /**
  * Stop the PWM controller.
  *
@@ -333,12 +724,9 @@ static int setup_pwm(ws2811_t *ws2811)
 {
     ws2811_device_t *device = ws2811->device;
     volatile dma_t *dma = device->dma;
-    volatile dma_cb_t *dma_cb = device->dma_cb;
     volatile pwm_t *pwm = device->pwm;
     volatile cm_clk_t *cm_clk = device->cm_clk;
-    int maxcount = device->max_count;
     uint32_t freq = ws2811->freq;
-    int32_t byte_count;
 
     const rpi_hw_t *rpi_hw = ws2811->rpi_hw;
     const uint32_t rpi_type = rpi_hw->type;
@@ -383,20 +771,13 @@ static int setup_pwm(ws2811_t *ws2811)
     usleep(10);
     pwm->ctl |= RPI_PWM_CTL_PWEN1 | RPI_PWM_CTL_PWEN2;
 
-    // Initialize the DMA control block
-    byte_count = PWM_BYTE_COUNT(maxcount, freq);
-    dma_cb->ti = RPI_DMA_TI_NO_WIDE_BURSTS |  // 32-bit transfers
-                 RPI_DMA_TI_WAIT_RESP |       // wait for write complete
-                 RPI_DMA_TI_DEST_DREQ |       // user peripheral flow control
-                 RPI_DMA_TI_PERMAP(5) |       // PWM peripheral
-                 RPI_DMA_TI_SRC_INC;          // Increment src addr
-
-    dma_cb->source_ad = addr_to_bus(device, device->pxl_raw);
-
-    dma_cb->dest_ad = (uintptr_t)&((pwm_t *)PWM_PERIPH_PHYS)->fif1;
-    dma_cb->txfr_len = byte_count;
-    dma_cb->stride = 0;
-    dma_cb->nextconbk = 0;
+    // Initialize the DMA control block chains, one per buffer
+    setup_dma_chains(device,
+                     RPI_DMA_TI_NO_WIDE_BURSTS |  // 32-bit transfers
+                     RPI_DMA_TI_WAIT_RESP |       // wait for write complete
+                     RPI_DMA_TI_DEST_DREQ |       // user peripheral flow control
+                     RPI_DMA_TI_PERMAP(5),        // PWM peripheral
+                     (uintptr_t)&((pwm_t *)PWM_PERIPH_PHYS)->fif1);
 
     dma->cs = 0;
     dma->txfr_len = 0;
@@ -415,13 +796,9 @@ static int setup_pcm(ws2811_t *ws2811)
 {
     ws2811_device_t *device = ws2811->device;
     volatile dma_t *dma = device->dma;
-    volatile dma_cb_t *dma_cb = device->dma_cb;
     volatile pcm_t *pcm = device->pcm;
     volatile cm_clk_t *cm_clk = device->cm_clk;
-    //int maxcount = max_channel_led_count(ws2811);
-    int maxcount = device->max_count;
     uint32_t freq = ws2811->freq;
-    int32_t byte_count;
 
     const rpi_hw_t *rpi_hw = ws2811->rpi_hw;
     const uint32_t rpi_type = rpi_hw->type;
@@ -457,19 +834,13 @@ static int setup_pcm(ws2811_t *ws2811)
     pcm->cs |= RPI_PCM_CS_DMAEN;         // Enable DMA DREQ
     pcm->dreq = (RPI_PCM_DREQ_TX(0x3F) | RPI_PCM_DREQ_TX_PANIC(0x10)); // Set FIFO tresholds
 
-    // Initialize the DMA control block
-    byte_count = PCM_BYTE_COUNT(maxcount, freq);
-    dma_cb->ti = RPI_DMA_TI_NO_WIDE_BURSTS |  // 32-bit transfers
-                 RPI_DMA_TI_WAIT_RESP |       // wait for write complete
-                 RPI_DMA_TI_DEST_DREQ |       // user peripheral flow control
-                 RPI_DMA_TI_PERMAP(2) |       // PCM TX peripheral
-                 RPI_DMA_TI_SRC_INC;          // Increment src addr
-
-    dma_cb->source_ad = addr_to_bus(device, device->pxl_raw);
-    dma_cb->dest_ad = (uintptr_t)&((pcm_t *)PCM_PERIPH_PHYS)->fifo;
-    dma_cb->txfr_len = byte_count;
-    dma_cb->stride = 0;
-    dma_cb->nextconbk = 0;
+    // Initialize the DMA control block chains, one per buffer
+    setup_dma_chains(device,
+                     RPI_DMA_TI_NO_WIDE_BURSTS |  // 32-bit transfers
+                     RPI_DMA_TI_WAIT_RESP |       // wait for write complete
+                     RPI_DMA_TI_DEST_DREQ |       // user peripheral flow control
+                     RPI_DMA_TI_PERMAP(2),        // PCM TX peripheral
+                     (uintptr_t)&((pcm_t *)PCM_PERIPH_PHYS)->fifo);
 
     dma->cs = 0;
     dma->txfr_len = 0;
@@ -478,28 +849,44 @@ static int setup_pcm(ws2811_t *ws2811)
 }
 
 /**
- * Start the DMA feeding the PWM FIFO.  This will stream the entire DMA buffer out of both
- * PWM channels.
+ * Start the DMA engine on a control block chain feeding the PWM or PCM FIFO.  A
+ * channel that finished its last transfer without errors is restarted by loading
+ * the chain and setting it active.  The reset sequence, which has to sleep, is
+ * only used for the first transfer and to recover from errors.  The time spent
+ * starting the engine, the reset included, is added to stats.kick_us.
  *
- * @param    ws2811  ws2811 instance pointer.
+ * @param    ws2811       ws2811 instance pointer.
+ * @param    dma_cb_addr  Bus address of the first control block.
  *
  * @returns  None
  */
-static void dma_start(ws2811_t *ws2811)
+static void dma_run(ws2811_t *ws2811, uint32_t dma_cb_addr)
 {
     ws2811_device_t *device = ws2811->device;
     volatile dma_t *dma = device->dma;
     volatile pcm_t *pcm = device->pcm;
-    uint32_t dma_cb_addr = device->dma_cb_addr;
+    uint64_t start = get_microsecond_timestamp();
 
-    dma->cs = RPI_DMA_CS_RESET;
-    usleep(10);
+    if (!device->dma_reset_done ||
+        (dma->cs & (RPI_DMA_CS_ACTIVE | RPI_DMA_CS_ERROR)) ||
+        (dma->debug & RPI_DMA_DEBUG_ERRORS))
+    {
+        dma->cs = RPI_DMA_CS_RESET;
+        usleep(10);
 
-    dma->cs = RPI_DMA_CS_INT | RPI_DMA_CS_END;
-    usleep(10);
+        dma->cs = RPI_DMA_CS_INT | RPI_DMA_CS_END;
+        usleep(10);
+
+        dma->debug = RPI_DMA_DEBUG_ERRORS; // clear debug error flags
+        device->dma_reset_done = 1;
+        ws2811->stats.dma_resets++;
+    }
+    else
+    {
+        dma->cs = RPI_DMA_CS_INT | RPI_DMA_CS_END;  // Left set by the previous transfer
+    }
 
     dma->conblk_ad = dma_cb_addr;
-    dma->debug = 7; // clear debug error flags
     dma->cs = RPI_DMA_CS_WAIT_OUTSTANDING_WRITES |
               RPI_DMA_CS_PANIC_PRIORITY(15) |
               RPI_DMA_CS_PRIORITY(15) |
@@ -509,6 +896,63 @@ static void dma_start(ws2811_t *ws2811)
     {
         pcm->cs |= RPI_PCM_CS_TXON;  // Start transmission
     }
+
+    ws2811->stats.kick_us += get_microsecond_timestamp() - start;
+}
+
+/**
+ * Start the DMA feeding the PWM FIFO.  This will stream the entire DMA buffer out of both
+ * PWM channels.  The buffer just started becomes busy, and the other one becomes the
+ * buffer the next frame is rendered into.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  0 on success, value from ws2811_return_t enum otherwise.
+ */
+static ws2811_return_t dma_start(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+
+    dma_run(ws2811, device->dma_cb_addr);
+    select_dma_buffer(device, device->buf_index ^ 1);
+    device->dma_done_us = get_microsecond_timestamp() + device->dma_time_us;
+
+    return WS2811_SUCCESS;
+}
+
+/**
+ * Wait for the DMA transfer to complete.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  0 on success, -1 on DMA competion error
+ */
+static ws2811_return_t dma_wait(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+    volatile dma_t *dma = device->dma;
+    uint64_t now;
+
+    // Sleep through most of the transfer at once, then poll for the end of it
+    now = get_microsecond_timestamp();
+    if (device->dma_done_us > now + DMA_WAIT_MARGIN_US)
+    {
+        usleep(device->dma_done_us - now - DMA_WAIT_MARGIN_US);
+    }
+
+    while ((dma->cs & RPI_DMA_CS_ACTIVE) &&
+           !(dma->cs & RPI_DMA_CS_ERROR))
+    {
+        usleep(10);
+    }
+
+    if (dma->cs & RPI_DMA_CS_ERROR)
+    {
+        fprintf(stderr, "DMA Error: %08x\n", dma->debug);
+        return WS2811_ERROR_DMA;
+    }
+
+    return WS2811_SUCCESS;
 }
 
 /**
@@ -555,55 +999,34 @@ static int gpio_init(ws2811_t *ws2811)
 }
 
 /**
- * Initialize the PWM DMA buffer with all zeros, inverted operation will be
- * handled by hardware.  The DMA buffer length is assumed to be a word
- * multiple.
+ * Pick the encoder kernels for the channel's strip type and the driver mode.
+ * Both the normal and the inverted kernel are kept, as invert may change between frames.
  *
  * @param    ws2811  ws2811 instance pointer.
+ * @param    chan    Channel number.
  *
  * @returns  None
  */
-void pwm_raw_init(ws2811_t *ws2811)
+static void select_kernels(ws2811_t *ws2811, int chan)
 {
-    volatile uint32_t *pxl_raw = (uint32_t *)ws2811->device->pxl_raw;
-    int maxcount = ws2811->device->max_count;
-    int wordcount = (PWM_BYTE_COUNT(maxcount, ws2811->freq) / sizeof(uint32_t)) /
-                    RPI_PWM_CHANNELS;
-    int chan;
-
-    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
-    {
-        int i, wordpos = chan;
-
-        for (i = 0; i < wordcount; i++)
-        {
-            pxl_raw[wordpos] = 0x0;
-            wordpos += 2;
-        }
-    }
-}
+    ws2811_device_t *device = ws2811->device;
+    int layout = device->backend->layout;
 
-/**
- * Initialize the PCM DMA buffer with all zeros.
- * The DMA buffer length is assumed to be a word multiple.
- *
- * @param    ws2811  ws2811 instance pointer.
- *
- * @returns  None
- */
-void pcm_raw_init(ws2811_t *ws2811)
-{
-    volatile uint32_t *pxl_raw = (uint32_t *)ws2811->device->pxl_raw;
-    int maxcount = ws2811->device->max_count;
-    int wordcount = PCM_BYTE_COUNT(maxcount, ws2811->freq) / sizeof(uint32_t);
-    int i;
+    device->kernel[chan][0] = encode_get_kernel(layout, ws2811->channel[chan].strip_type, 0);
+    device->kernel[chan][1] = encode_get_kernel(layout, ws2811->channel[chan].strip_type, 1);
 
-    for (i = 0; i < wordcount; i++)
+    device->pair_kernel[chan] = NULL;
+    if (layout == ENCODE_LAYOUT_PWM)
     {
-        pxl_raw[i] = 0x0;
+        device->pair_kernel[chan] = encode_get_kernel(ENCODE_LAYOUT_PCM, ws2811->channel[chan].strip_type, 0);
     }
 }
 
+static void encode_pool_stop(ws2811_device_t *device);
+static ws2811_return_t frame_queue_start(ws2811_t *ws2811);
+static void frame_queue_stop(ws2811_device_t *device);
+static void frame_cache_free(ws2811_device_t *device);
+
 /**
  * Cleanup previously allocated device memory and buffers.
  *
@@ -616,6 +1039,13 @@ void ws2811_cleanup(ws2811_t *ws2811)
     ws2811_device_t *device = ws2811->device;
     int chan;
 
+    if (device)
+    {
+        frame_queue_stop(device);
+        encode_pool_stop(device);
+        frame_cache_free(device);
+    }
+
     for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
     {
         if (ws2811->channel[chan].leds)
@@ -628,25 +1058,49 @@ void ws2811_cleanup(ws2811_t *ws2811)
             free(ws2811->channel[chan].gamma);
         }
         ws2811->channel[chan].gamma = NULL;
+
+        if (device && device->shadow[chan].leds)
+        {
+            free(device->shadow[chan].leds);
+            device->shadow[chan].leds = NULL;
+        }
     }
 
-    if (device->mbox.handle != -1)
+    if (device->pxl_stage)
     {
-        videocore_mbox_t *mbox = &device->mbox;
-
-        unmapmem(mbox->virt_addr, mbox->size);
-        mem_unlock(mbox->handle, mbox->mem_ref);
-        mem_free(mbox->handle, mbox->mem_ref);
-        mbox_close(mbox->handle);
+        free(device->pxl_stage);
+        device->pxl_stage = NULL;
+    }
 
-        mbox->handle = -1;
+    if (device->loop)
+    {
+        dma_mem_free(&device->loop->mbox);
+        free(device->loop);
+        device->loop = NULL;
     }
 
+    dma_mem_free(&device->mbox);
+
     if (device && (device->spi_fd > 0))
     {
         close(device->spi_fd);
     }
 
+    if (device && (device->completion_fd > 0))
+    {
+        close(device->completion_fd);
+    }
+
+    if (device && (device->capture_fd > 0))
+    {
+        close(device->capture_fd);
+    }
+
+    if (device && device->capture_buf)
+    {
+        free(device->capture_buf);
+    }
+
     if (device) {
         free(device);
     }
@@ -744,8 +1198,6 @@ static int check_hwver_and_gpionum(ws2811_t *ws2811)
 static ws2811_return_t spi_init(ws2811_t *ws2811)
 {
     int spi_fd;
-    static uint8_t mode;
-    static uint8_t bits = 8;
     uint32_t speed = ws2811->freq * 3;
     ws2811_device_t *device = ws2811->device;
     uint32_t base = ws2811->rpi_hw->periph_base;
@@ -757,23 +1209,25 @@ static ws2811_return_t spi_init(ws2811_t *ws2811)
         return WS2811_ERROR_SPI_SETUP;
     }
     device->spi_fd = spi_fd;
+    device->spi_mode = 0;
+    device->spi_bits = 8;
 
     // SPI mode
-    if (ioctl(spi_fd, SPI_IOC_WR_MODE, &mode) < 0)
+    if (ioctl(spi_fd, SPI_IOC_WR_MODE, &device->spi_mode) < 0)
     {
         return WS2811_ERROR_SPI_SETUP;
     }
-    if (ioctl(spi_fd, SPI_IOC_RD_MODE, &mode) < 0)
+    if (ioctl(spi_fd, SPI_IOC_RD_MODE, &device->spi_mode) < 0)
     {
         return WS2811_ERROR_SPI_SETUP;
     }
 
     // Bits per word
-    if (ioctl(spi_fd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0)
+    if (ioctl(spi_fd, SPI_IOC_WR_BITS_PER_WORD, &device->spi_bits) < 0)
     {
         return WS2811_ERROR_SPI_SETUP;
     }
-    if (ioctl(spi_fd, SPI_IOC_RD_BITS_PER_WORD, &bits) < 0)
+    if (ioctl(spi_fd, SPI_IOC_RD_BITS_PER_WORD, &device->spi_bits) < 0)
     {
         return WS2811_ERROR_SPI_SETUP;
     }
@@ -788,17 +1242,6 @@ static ws2811_return_t spi_init(ws2811_t *ws2811)
         return WS2811_ERROR_SPI_SETUP;
     }
 
-    // Initialize device structure elements to not used
-    // except driver_mode, spi_fd and max_count (already defined when spi_init called)
-    device->pxl_raw = NULL;
-    device->dma = NULL;
-    device->pwm = NULL;
-    device->pcm = NULL;
-    device->dma_cb = NULL;
-    device->dma_cb_addr = 0;
-    device->cm_clk = NULL;
-    device->mbox.handle = -1;
-
     // Set SPI-MOSI pin
     device->gpio = mapmem(GPIO_OFFSET + base, sizeof(gpio_t), DEV_GPIOMEM);
     if (!device->gpio)
@@ -807,43 +1250,13 @@ static ws2811_return_t spi_init(ws2811_t *ws2811)
     }
     gpio_function_set(device->gpio, pinnum, 0);	// SPI-MOSI ALT0
 
-    // Allocate LED buffer
-    ws2811_channel_t *channel = &ws2811->channel[0];
-    channel->leds = malloc(sizeof(ws2811_led_t) * channel->count);
-    if (!channel->leds)
-    {
-        ws2811_cleanup(ws2811);
-        return WS2811_ERROR_OUT_OF_MEMORY;
-    }
-    memset(channel->leds, 0, sizeof(ws2811_led_t) * channel->count);
-    if (!channel->strip_type)
-    {
-      channel->strip_type=WS2811_STRIP_RGB;
-    }
-
-    // Set default uncorrected gamma table
-    if (!channel->gamma)
-    {
-      channel->gamma = malloc(sizeof(uint8_t) * 256);
-      int x;
-      for(x = 0; x < 256; x++){
-        channel->gamma[x] = x;
-      }
-    }
-
-    channel->wshift = (channel->strip_type >> 24) & 0xff;
-    channel->rshift = (channel->strip_type >> 16) & 0xff;
-    channel->gshift = (channel->strip_type >> 8)  & 0xff;
-    channel->bshift = (channel->strip_type >> 0)  & 0xff;
-
     // Allocate SPI transmit buffer (same size as PCM)
-    device->pxl_raw = malloc(PCM_BYTE_COUNT(device->max_count, ws2811->freq));
+    device->pxl_raw = malloc(device->pxl_size);
     if (device->pxl_raw == NULL)
     {
-        ws2811_cleanup(ws2811);
         return WS2811_ERROR_OUT_OF_MEMORY;
     }
-    pcm_raw_init(ws2811);
+    memset((uint8_t *)device->pxl_raw, 0, device->pxl_size);
 
     return WS2811_SUCCESS;
 }
@@ -856,7 +1269,7 @@ static ws2811_return_t spi_transfer(ws2811_t *ws2811)
     memset(&tr, 0, sizeof(struct spi_ioc_transfer));
     tr.tx_buf = (unsigned long)ws2811->device->pxl_raw;
     tr.rx_buf = 0;
-    tr.len = PCM_BYTE_COUNT(ws2811->device->max_count, ws2811->freq);
+    tr.len = ws2811->device->pxl_size;
 
     ret = ioctl(ws2811->device->spi_fd, SPI_IOC_MESSAGE(1), &tr);
     if (ret < 1)
@@ -868,425 +1281,2562 @@ static ws2811_return_t spi_transfer(ws2811_t *ws2811)
     return WS2811_SUCCESS;
 }
 
+/**
+ * Nothing to wait for, the SPI driver returns once the frame was sent.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  0
+ */
+static ws2811_return_t spi_wait(ws2811_t *ws2811)
+{
+    (void)ws2811;
 
-/*
+    return WS2811_SUCCESS;
+}
+
+/**
+ * Release the GPIO mapping of the SPI backend.  The SPI device is closed by
+ * ws2811_cleanup().
  *
- * Application API Functions
+ * @param    ws2811  ws2811 instance pointer.
  *
+ * @returns  None
  */
+static void spi_fini(ws2811_t *ws2811)
+{
+    unmap_registers(ws2811);
+    free((uint8_t *)ws2811->device->pxl_raw);
+    ws2811->device->pxl_raw = NULL;
+}
 
 
 /**
- * Allocate and initialize memory, buffers, pages, PWM, DMA, and GPIO.
+ * Return the combined brightness and gamma table of a channel, rebuilding it if
+ * either input changed since the last render.
  *
  * @param    ws2811  ws2811 instance pointer.
+ * @param    chan    Channel number.
  *
- * @returns  0 on success, -1 otherwise.
+ * @returns  256 entry lookup table.
  */
-ws2811_return_t ws2811_init(ws2811_t *ws2811)
+static const uint8_t *channel_lut(ws2811_t *ws2811, int chan)
 {
-    ws2811_device_t *device;
-    const rpi_hw_t *rpi_hw;
-    int chan;
+    ws2811_channel_t *channel = &ws2811->channel[chan];
+    channel_lut_t *lut = &ws2811->device->lut[chan];
 
-    ws2811->rpi_hw = rpi_hw_detect();
-    if (!ws2811->rpi_hw)
+    if (!lut->valid || (lut->brightness != channel->brightness) ||
+        memcmp(lut->gamma, channel->gamma, sizeof(lut->gamma)))
     {
-        return WS2811_ERROR_HW_NOT_SUPPORTED;
-    }
-    rpi_hw = ws2811->rpi_hw;
+        const int scale = (channel->brightness & 0xff) + 1;
+        int i;
+
+        for (i = 0; i < 256; i++)
+        {
+            lut->lut[i] = channel->gamma[(i * scale) >> 8];
+        }
+
+        memcpy(lut->gamma, channel->gamma, sizeof(lut->gamma));
+        lut->brightness = channel->brightness;
+        lut->valid = 1;
+        lut->generation++;
+
+        // Everything encoded with the old table is out of date
+        ws2811->device->shadow[chan].valid = 0;
+    }
+
+    return lut->lut;
+}
+
+/**
+ * Check whether any LED of a group of 4 differs from the value last encoded.
+ *
+ * @param    channel  Channel pointer.
+ * @param    leds     LED values to encode.
+ * @param    shadow   Shadow copy of the channel.
+ * @param    first    First LED of the group.
+ *
+ * @returns  Non-zero if the group needs to be encoded.
+ */
+static int group_changed(ws2811_channel_t *channel, const ws2811_led_t *leds, channel_shadow_t *shadow,
+                         int first)
+{
+    int count = channel->count - first;
+
+    if (count > 4)
+    {
+        count = 4;
+    }
+
+    return memcmp(&leds[first], &shadow->leds[first], count * sizeof(ws2811_led_t));
+}
+
+/**
+ * Encode a range of LEDs of one channel into a render buffer.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ * @param    chan    Channel number.
+ * @param    leds    LED values of the channel.
+ * @param    lut     Brightness and gamma table of the channel.
+ * @param    pxl     Render buffer, laid out like the DMA buffer.
+ * @param    first   First LED, a multiple of 4 so the range starts on a word boundary.
+ * @param    count   Number of LEDs, at most RENDER_CHUNK_LEDS.
+ *
+ * @returns  None
+ */
+static void encode_leds(ws2811_t *ws2811, int chan, const ws2811_led_t *leds, const uint8_t *lut,
+                        volatile uint8_t *pxl, int first, int count)
+{
+    ws2811_channel_t *channel = &ws2811->channel[chan];
+    const int invert = (ws2811->device->driver_mode != PWM) && channel->invert;
+
+    ws2811->device->kernel[chan][invert]->fn(pxl + (chan * sizeof(uint32_t)), leds, lut, first, count,
+                                             channel->strip_type);
+}
+
+/**
+ * Grow a word range to include another one.  Empty ranges have lo >= hi.
+ *
+ * @param    lo      Start of the range to grow.
+ * @param    hi      End of the range to grow, exclusive.
+ * @param    add_lo  Start of the range to add.
+ * @param    add_hi  End of the range to add, exclusive.
+ *
+ * @returns  None
+ */
+static void span_add(int *lo, int *hi, int add_lo, int add_hi)
+{
+    if (add_lo >= add_hi)
+    {
+        return;
+    }
+
+    if (*lo >= *hi)
+    {
+        *lo = add_lo;
+        *hi = add_hi;
+        return;
+    }
+
+    if (add_lo < *lo)
+    {
+        *lo = add_lo;
+    }
+    if (add_hi > *hi)
+    {
+        *hi = add_hi;
+    }
+}
+
+/**
+ * Check whether both PWM channels can be encoded together in a single pass.  That is
+ * the case when every channel in use has to be encoded in full.
+ *
+ * @param    ws2811       ws2811 instance pointer.
+ * @param    incremental  Render buffer keeps its contents between frames.
+ *
+ * @returns  Non-zero if encode_pwm_pair() can be used.
+ */
+static int pwm_pair_ready(ws2811_t *ws2811, int incremental)
+{
+    ws2811_device_t *device = ws2811->device;
+    int used = 0;
+    int chan;
+
+    if (device->driver_mode != PWM)
+    {
+        return 0;
+    }
+
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        if (!ws2811->channel[chan].count)
+        {
+            continue;
+        }
+
+        if (incremental && device->shadow[chan].valid)
+        {
+            return 0;
+        }
+
+        used++;
+    }
+
+    return used;
+}
+
+/**
+ * Encode both PWM channels in one pass, storing the interleaved word pairs in order
+ * instead of making a strided pass over the buffer per channel.  The shorter channel
+ * is padded with zero words.  Each part of the job gets a range of whole blocks.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ * @param    job     Frame being encoded.
+ * @param    part    Part of the job to encode.
+ * @param    result  Updated with what was encoded.
+ *
+ * @returns  None
+ */
+static void encode_pwm_pair(ws2811_t *ws2811, encode_job_t *job, int part, encode_result_t *result)
+{
+    ws2811_device_t *device = ws2811->device;
+    uint32_t block[RPI_PWM_CHANNELS][PAIR_BLOCK_WORDS];
+    int words[RPI_PWM_CHANNELS];
+    int block_leds[RPI_PWM_CHANNELS];
+    int total = 0;
+    int blocks, first, last, pos, chan;
+
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        ws2811_channel_t *channel = &ws2811->channel[chan];
+        const int led_bytes = channel_colours(channel) * ENCODE_BYTES_PER_COLOUR;
+
+        words[chan] = ((channel->count * led_bytes) + sizeof(uint32_t) - 1) / sizeof(uint32_t);
+        block_leds[chan] = (PAIR_BLOCK_WORDS * sizeof(uint32_t)) / led_bytes;
+
+        if (words[chan] > total)
+        {
+            total = words[chan];
+        }
+    }
+
+    blocks = (total + PAIR_BLOCK_WORDS - 1) / PAIR_BLOCK_WORDS;
+    first = (blocks * part) / job->parts;
+    last = (blocks * (part + 1)) / job->parts;
+
+    for (pos = first * PAIR_BLOCK_WORDS; pos < total && pos < last * PAIR_BLOCK_WORDS; pos += PAIR_BLOCK_WORDS)
+    {
+        const int block_words = total - pos < PAIR_BLOCK_WORDS ? total - pos : PAIR_BLOCK_WORDS;
+        int valid[RPI_PWM_CHANNELS];
+
+        for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+        {
+            ws2811_channel_t *channel = &ws2811->channel[chan];
+            const int led = (pos / PAIR_BLOCK_WORDS) * block_leds[chan];
+            int leds = channel->count - led;
+
+            valid[chan] = 0;
+            if (leds <= 0)
+            {
+                continue;
+            }
+
+            if (leds > block_leds[chan])
+            {
+                leds = block_leds[chan];
+            }
+
+            device->pair_kernel[chan]->fn((volatile uint8_t *)block[chan], &job->leds[chan][led],
+                                          job->lut[chan], 0, leds, channel->strip_type);
+            if (job->incremental)
+            {
+                memcpy(&device->shadow[chan].leds[led], &job->leds[chan][led], leds * sizeof(ws2811_led_t));
+            }
+
+            valid[chan] = words[chan] - pos < block_words ? words[chan] - pos : block_words;
+            result->encoded[chan] += leds;
+        }
+
+        encode_interleave_words((volatile uint32_t *)job->pxl + (pos * 2), block[0], valid[0],
+                                block[1], valid[1], block_words);
+        span_add(&result->span_lo, &result->span_hi, pos * 2, (pos + block_words) * 2);
+    }
+}
+
+/**
+ * Encode the LEDs of one channel that changed, or all of them for a full encode.
+ * Each part of the job gets a range of LEDs starting on a multiple of 4.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ * @param    job     Frame being encoded.
+ * @param    chan    Channel number.
+ * @param    part    Part of the job to encode.
+ * @param    result  Updated with what was encoded.
+ *
+ * @returns  None
+ */
+static void encode_channel(ws2811_t *ws2811, encode_job_t *job, int chan, int part,
+                           encode_result_t *result)
+{
+    ws2811_channel_t *channel = &ws2811->channel[chan];
+    channel_shadow_t *shadow = &ws2811->device->shadow[chan];
+    const int led_bytes = channel_colours(channel) * ENCODE_BYTES_PER_COLOUR;
+    const int stride = ws2811->device->driver_mode == PWM ? 2 : 1;
+    const int full = job->full[chan];
+    int i = ((channel->count * part) / job->parts) & ~3;
+    int end = ((channel->count * (part + 1)) / job->parts) & ~3;
+
+    if (part == job->parts - 1)
+    {
+        end = channel->count;
+    }
+
+    while (i < end)
+    {
+        int leds = 0;
+
+        // Collect a run of changed LEDs, in groups of 4 to keep it word aligned
+        while ((i + leds < end) && (leds < RENDER_CHUNK_LEDS) &&
+               (full || group_changed(channel, job->leds[chan], shadow, i + leds)))
+        {
+            leds += 4;
+        }
+
+        if (!leds)
+        {
+            i += 4;
+            continue;
+        }
+
+        if (i + leds > end)
+        {
+            leds = end - i;
+        }
+
+        encode_leds(ws2811, chan, job->leds[chan], job->lut[chan], job->pxl, i, leds);
+        if (job->incremental)
+        {
+            memcpy(&shadow->leds[i], &job->leds[chan][i], leds * sizeof(ws2811_led_t));
+        }
+
+        // Buffer words touched, including a trailing partial word
+        span_add(&result->span_lo, &result->span_hi,
+                 chan + (((i * led_bytes) / sizeof(uint32_t)) * stride),
+                 chan + (((((i + leds) * led_bytes) + sizeof(uint32_t) - 1) / sizeof(uint32_t)) - 1) *
+                        stride + 1);
+
+        result->encoded[chan] += leds;
+        i += leds;
+    }
+}
+
+/**
+ * Encode one part of a frame.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ * @param    job     Frame being encoded.
+ * @param    part    Part of the job to encode, less than job->parts.
+ * @param    result  Set to what was encoded.
+ *
+ * @returns  None
+ */
+static void encode_part(ws2811_t *ws2811, encode_job_t *job, int part, encode_result_t *result)
+{
+    int chan;
+
+    memset(result, 0, sizeof(*result));
+
+    if (job->paired)
+    {
+        encode_pwm_pair(ws2811, job, part, result);
+        return;
+    }
+
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        if (ws2811->channel[chan].count)
+        {
+            encode_channel(ws2811, job, chan, part, result);
+        }
+    }
+}
+
+static void *encode_worker(void *arg)
+{
+    encode_worker_t *worker = arg;
+    encode_pool_t *pool = worker->pool;
+    unsigned int seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1)
+    {
+        while (!pool->stop && (pool->generation == seen))
+        {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+
+        if (pool->stop)
+        {
+            break;
+        }
+
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        encode_part(pool->ws2811, &pool->job, worker->part, &pool->results[worker->part]);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->busy == 0)
+        {
+            pthread_cond_signal(&pool->done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+/**
+ * Start the encoder threads requested in ws2811->encode_threads.  Failing to start
+ * them isn't fatal, the frame is then encoded by fewer threads.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  None
+ */
+static void encode_pool_start(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+    encode_pool_t *pool;
+    int threads = ws2811->encode_threads - 1;       // The rendering thread encodes too
+    int i;
+
+    if (threads <= 0)
+    {
+        return;
+    }
+
+    if (threads > ENCODE_MAX_THREADS)
+    {
+        threads = ENCODE_MAX_THREADS;
+    }
+
+    pool = calloc(1, sizeof(*pool));
+    if (!pool)
+    {
+        return;
+    }
+
+    pool->ws2811 = ws2811;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    for (i = 0; i < threads; i++)
+    {
+        encode_worker_t *worker = &pool->workers[pool->count];
+
+        worker->pool = pool;
+        worker->part = pool->count + 1;
+        if (pthread_create(&worker->thread, NULL, encode_worker, worker))
+        {
+            break;
+        }
+
+        pool->count++;
+    }
+
+    device->pool = pool;
+}
+
+/**
+ * Stop the encoder threads and free the pool.
+ *
+ * @param    device  Device pointer.
+ *
+ * @returns  None
+ */
+static void encode_pool_stop(ws2811_device_t *device)
+{
+    encode_pool_t *pool = device->pool;
+    int i;
+
+    if (!pool)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->count; i++)
+    {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+    device->pool = NULL;
+}
+
+/**
+ * Encode a frame, spread over the encoder threads for long strips.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ * @param    job     Frame to encode.
+ * @param    result  Set to what was encoded.
+ *
+ * @returns  None
+ */
+static void encode_run(ws2811_t *ws2811, encode_job_t *job, encode_result_t *result)
+{
+    encode_pool_t *pool = ws2811->device->pool;
+    int part, chan;
+
+    if (!pool || !pool->count ||
+        (ws2811->channel[0].count + ws2811->channel[1].count < THREAD_MIN_LEDS))
+    {
+        job->parts = 1;
+        encode_part(ws2811, job, 0, result);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->job = *job;
+    pool->job.parts = pool->count + 1;
+    pool->busy = pool->count;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    encode_part(ws2811, &pool->job, 0, &pool->results[0]);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->busy)
+    {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    memset(result, 0, sizeof(*result));
+    for (part = 0; part <= pool->count; part++)
+    {
+        span_add(&result->span_lo, &result->span_hi, pool->results[part].span_lo,
+                 pool->results[part].span_hi);
+        for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+        {
+            result->encoded[chan] += pool->results[part].encoded[chan];
+        }
+    }
+}
+
+/**
+ * Burst copy part of an encoded frame from a cached buffer, such as the staging
+ * buffer, into the uncached DMA buffer.  Both buffers are word aligned, and only
+ * whole word stores are used since the DMA buffer is mapped as device memory.
+ *
+ * @param    dma_buf  DMA buffer to copy to.
+ * @param    buf      Encoded frame, laid out like the DMA buffer.
+ * @param    first    First 32-bit word to copy.
+ * @param    last     Word after the last one to copy.
+ *
+ * @returns  None
+ */
+static void copy_to_dma(volatile uint8_t *dma_buf, const uint8_t *buf, int first, int last)
+{
+    volatile uint32_t *dst = (volatile uint32_t *)dma_buf + first;
+    const uint32_t *src = (const uint32_t *)buf + first;
+    int words = last - first;
+    int i;
+
+    for (i = 0; i + 4 <= words; i += 4)
+    {
+        dst[i + 0] = src[i + 0];
+        dst[i + 1] = src[i + 1];
+        dst[i + 2] = src[i + 2];
+        dst[i + 3] = src[i + 3];
+    }
+
+    for (; i < words; i++)
+    {
+        dst[i] = src[i];
+    }
+}
+
+
+/**
+ * Arm the completion timerfd to expire when the next frame can be sent.  The
+ * timestamps are CLOCK_MONOTONIC_RAW, which timerfd doesn't support, so the
+ * timer is set relative to now.
+ *
+ * @param    device  Device pointer.
+ *
+ * @returns  None
+ */
+static void arm_completion_fd(ws2811_device_t *device)
+{
+    struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+    uint64_t now = get_microsecond_timestamp();
+    uint64_t delay = device->ready_us > now ? device->ready_us - now : 0;
+
+    if (device->completion_fd <= 0)
+    {
+        return;
+    }
+
+    its.it_value.tv_sec = delay / 1000000;
+    its.it_value.tv_nsec = (delay % 1000000) * 1000;
+
+    // A zero value would disarm the timer, expire right away instead
+    if (!delay)
+    {
+        its.it_value.tv_nsec = 1;
+    }
+
+    timerfd_settime(device->completion_fd, 0, &its, NULL);
+}
+
+/**
+ * Time it takes to send a frame to the LEDs, not counting the reset.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  Protocol time in microseconds.
+ */
+static uint32_t frame_protocol_time(ws2811_t *ws2811)
+{
+    uint32_t protocol_time = 0;
+    int chan;
+
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)         // Channel
+    {
+        ws2811_channel_t *channel = &ws2811->channel[chan];
+
+        // 1.25µs per bit
+        const uint32_t channel_protocol_time = channel->count * channel_colours(channel) * 8 * 1.25;
+
+        // Only using the channel which takes the longest as both run in parallel
+        if (channel_protocol_time > protocol_time)
+        {
+            protocol_time = channel_protocol_time;
+        }
+    }
+
+    return protocol_time;
+}
+
+/**
+ * Send the frame in pxl_raw once the previous one is done and the LEDs had time
+ * to reset.
+ *
+ * @param    ws2811         ws2811 instance pointer.
+ * @param    protocol_time  Time it takes to send the frame, from frame_protocol_time().
+ *
+ * @returns  0 on success, value from ws2811_return_t enum otherwise.
+ */
+static ws2811_return_t start_transfer(ws2811_t *ws2811, uint32_t protocol_time)
+{
+    ws2811_device_t *device = ws2811->device;
+    ws2811_return_t ret = WS2811_SUCCESS;
+
+    // Whatever is sent now replaces the frame ws2811_render() last sent
+    device->sent_valid = 0;
+
+    // Stop a running frame loop, and wait for any previous DMA operation to complete.
+    if (((ret = ws2811_loop_stop(ws2811)) != WS2811_SUCCESS) ||
+        ((ret = ws2811_wait(ws2811)) != WS2811_SUCCESS))
+    {
+        return ret;
+    }
+
+    // Captures that don't run in real time only advance their simulated clock
+    if ((ws2811->render_wait_time != 0) && !device->simulated) {
+        const uint64_t current_timestamp = get_microsecond_timestamp();
+        uint64_t time_diff = current_timestamp - device->previous_timestamp;
+
+        if (ws2811->render_wait_time > time_diff) {
+            usleep(ws2811->render_wait_time - time_diff);
+        }
+    }
+
+    ret = device->backend->start(ws2811);
+
+    // LED_RESET_WAIT_TIME is added to allow enough time for the reset to occur.
+    device->previous_timestamp = get_microsecond_timestamp();
+    ws2811->render_wait_time = protocol_time + LED_RESET_WAIT_TIME;
+
+    device->ready_us = device->previous_timestamp + ws2811->render_wait_time;
+    if (device->dma_done_us > device->ready_us)
+    {
+        device->ready_us = device->dma_done_us;
+    }
+    arm_completion_fd(device);
+
+    return ret;
+}
+
+/**
+ * Check whether ws2811_render() would send the frame it sent last time again: the
+ * LED values, brightness, gamma tables and inversion all match, and nothing else
+ * was sent since.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  1 if the frame is unchanged, 0 otherwise.
+ */
+static int frame_unchanged(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+    int chan;
+
+    if (!device->sent_valid)
+    {
+        return 0;
+    }
+
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        ws2811_channel_t *channel = &ws2811->channel[chan];
+        channel_shadow_t *shadow = &device->shadow[chan];
+
+        if (!channel->count)
+        {
+            continue;
+        }
+
+        // Brightness and gamma changes show up as a new table generation
+        channel_lut(ws2811, chan);
+        if ((device->lut[chan].generation != shadow->generation) ||
+            (shadow->invert != ((device->driver_mode != PWM) && channel->invert)) ||
+            memcmp(channel->leds, shadow->leds, sizeof(ws2811_led_t) * channel->count))
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Current CLOCK_MONOTONIC time, the clock ws2811_submit() presentation times use.
+ *
+ * @returns  Current timestamp in microseconds or 0 on error.
+ */
+static uint64_t get_monotonic_timestamp(void)
+{
+    struct timespec t;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &t) != 0) {
+        return 0;
+    }
+
+    return (uint64_t) t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+/**
+ * Give the oldest queued frame's slot back to the producer.  Called with the
+ * queue locked.
+ *
+ * @param    queue  Frame queue pointer.
+ *
+ * @returns  None
+ */
+static void frame_queue_release(frame_queue_t *queue)
+{
+    queue->head = (queue->head + 1) % queue->depth;
+    queue->count--;
+    pthread_cond_signal(&queue->space);
+}
+
+static void *frame_queue_thread(void *arg)
+{
+    ws2811_t *ws2811 = arg;
+    ws2811_device_t *device = ws2811->device;
+    frame_queue_t *queue = device->queue;
+    uint64_t sent_at_us = 0;
+    int sent = 0;
+
+    pthread_mutex_lock(&queue->lock);
+    while (1)
+    {
+        frame_slot_t *slot;
+        uint64_t present_at_us;
+        uint64_t next_at_us;
+
+        if (!queue->count && sent && !queue->stop)
+        {
+            // Nothing else to send, report the last frame once it is out
+            pthread_mutex_unlock(&queue->lock);
+            ws2811_wait(ws2811);
+            if (ws2811->frame_done)
+            {
+                ws2811->frame_done(ws2811, sent_at_us, ws2811->callback_arg);
+            }
+            sent = 0;
+            pthread_mutex_lock(&queue->lock);
+            continue;
+        }
+
+        while (!queue->stop && !queue->count)
+        {
+            pthread_cond_wait(&queue->wake, &queue->lock);
+        }
+
+        if (queue->stop)
+        {
+            break;
+        }
+
+        slot = &queue->slots[queue->head];
+        present_at_us = slot->present_at_us;
+
+        // A frame is stale once the frame after it is due.  Frames without a
+        // time are sent as soon as possible, but never skipped.
+        next_at_us = (queue->count > 1) ?
+                     queue->slots[(queue->head + 1) % queue->depth].present_at_us : 0;
+        if (next_at_us && (next_at_us <= get_monotonic_timestamp()))
+        {
+            frame_queue_release(queue);
+            pthread_mutex_unlock(&queue->lock);
+            if (ws2811->frame_dropped)
+            {
+                ws2811->frame_dropped(ws2811, present_at_us, ws2811->callback_arg);
+            }
+            pthread_mutex_lock(&queue->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&queue->lock);
+
+        // The idle buffer can be filled while the previous frame is still going out
+        copy_to_dma(device->pxl_raw, slot->buf, slot->span_lo, slot->span_hi);
+
+        ws2811_wait(ws2811);
+        if (sent && ws2811->frame_done)
+        {
+            ws2811->frame_done(ws2811, sent_at_us, ws2811->callback_arg);
+        }
+        sent = 0;
+
+        pthread_mutex_lock(&queue->lock);
+        while (!queue->stop && (get_monotonic_timestamp() < present_at_us))
+        {
+            struct timespec ts =
+            {
+                .tv_sec = present_at_us / 1000000,
+                .tv_nsec = (present_at_us % 1000000) * 1000,
+            };
+
+            pthread_cond_timedwait(&queue->wake, &queue->lock, &ts);
+        }
+
+        if (queue->stop)
+        {
+            break;
+        }
+        pthread_mutex_unlock(&queue->lock);
+
+        start_transfer(ws2811, slot->protocol_time);
+        sent = 1;
+        sent_at_us = present_at_us;
+
+        pthread_mutex_lock(&queue->lock);
+        frame_queue_release(queue);
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return NULL;
+}
+
+/**
+ * Allocate the frame queue requested in ws2811->queue_depth and start its thread.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  0 on success, value from ws2811_return_t enum otherwise.
+ */
+static ws2811_return_t frame_queue_start(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+    frame_queue_t *queue;
+    pthread_condattr_t attr;
+    int i;
+
+    if (ws2811->queue_depth <= 0)
+    {
+        return WS2811_SUCCESS;
+    }
+
+    queue = calloc(1, sizeof(*queue));
+    if (!queue)
+    {
+        return WS2811_ERROR_OUT_OF_MEMORY;
+    }
+
+    queue->depth = ws2811->queue_depth;
+    queue->slots = calloc(queue->depth, sizeof(*queue->slots));
+    if (!queue->slots)
+    {
+        free(queue);
+        return WS2811_ERROR_OUT_OF_MEMORY;
+    }
+
+    // Unused parts of the buffers stay zero, like in the DMA buffers
+    for (i = 0; i < queue->depth; i++)
+    {
+        queue->slots[i].buf = calloc(1, device->pxl_size);
+        if (!queue->slots[i].buf)
+        {
+            while (i--)
+            {
+                free(queue->slots[i].buf);
+            }
+            free(queue->slots);
+            free(queue);
+            return WS2811_ERROR_OUT_OF_MEMORY;
+        }
+    }
+
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&queue->wake, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init(&queue->space, NULL);
+
+    device->queue = queue;
+    if (pthread_create(&queue->thread, NULL, frame_queue_thread, ws2811))
+    {
+        device->queue = NULL;
+        for (i = 0; i < queue->depth; i++)
+        {
+            free(queue->slots[i].buf);
+        }
+        free(queue->slots);
+        free(queue);
+        return WS2811_ERROR_GENERIC;
+    }
+
+    return WS2811_SUCCESS;
+}
+
+/**
+ * Stop the queue thread, dropping any frames not sent yet, and free the queue.
+ *
+ * @param    device  Device pointer.
+ *
+ * @returns  None
+ */
+static void frame_queue_stop(ws2811_device_t *device)
+{
+    frame_queue_t *queue = device->queue;
+    int i;
+
+    if (!queue)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&queue->lock);
+    queue->stop = 1;
+    pthread_cond_broadcast(&queue->wake);
+    pthread_cond_broadcast(&queue->space);
+    pthread_mutex_unlock(&queue->lock);
+
+    pthread_join(queue->thread, NULL);
+
+    pthread_cond_destroy(&queue->space);
+    pthread_cond_destroy(&queue->wake);
+    pthread_mutex_destroy(&queue->lock);
+    for (i = 0; i < queue->depth; i++)
+    {
+        free(queue->slots[i].buf);
+    }
+    free(queue->slots);
+    free(queue);
+    device->queue = NULL;
+}
+
+/**
+ * Encode a whole frame into a cached buffer laid out like the DMA buffer.  LEDs
+ * that aren't encoded, such as the padding after a shorter channel, are left as
+ * they are.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ * @param    leds    LED values per channel.  NULL, or a NULL entry, takes the
+ *                   values from channel[].leds.
+ * @param    buf     Buffer to encode into.
+ * @param    result  What was encoded.
+ *
+ * @returns  None
+ */
+static void encode_frame(ws2811_t *ws2811, const ws2811_led_t *const leds[RPI_PWM_CHANNELS], uint8_t *buf,
+                         encode_result_t *result)
+{
+    encode_job_t job = { .pxl = buf, .incremental = 0 };
+    int chan;
+
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        ws2811_channel_t *channel = &ws2811->channel[chan];
+
+        if (!channel->count)
+        {
+            continue;
+        }
+
+        job.leds[chan] = (leds && leds[chan]) ? leds[chan] : channel->leds;
+        job.lut[chan] = channel_lut(ws2811, chan);
+        job.full[chan] = 1;
+    }
+    job.paired = pwm_pair_ready(ws2811, job.incremental);
+
+    encode_run(ws2811, &job, result);
+}
+
+/**
+ * Free the frame cache when ws2811->frame_cache_size changed since it was
+ * allocated.  ws2811_render_store() allocates it again at the new size.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  None
+ */
+static void frame_cache_check_size(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+
+    if (device->cache && (device->cache->size != ws2811->frame_cache_size))
+    {
+        frame_cache_free(device);
+    }
+}
+
+/**
+ * Look up a frame stored by ws2811_render_store().  It only matches when it was
+ * encoded with the current brightness, gamma tables and output inversion.
+ *
+ * @param    ws2811    ws2811 instance pointer.
+ * @param    frame_id  Identity of the frame, chosen by the application.
+ *
+ * @returns  Cache entry, or NULL if the frame isn't cached.
+ */
+static frame_cache_entry_t *frame_cache_find(ws2811_t *ws2811, uint64_t frame_id)
+{
+    ws2811_device_t *device = ws2811->device;
+    frame_cache_t *cache;
+    int chan, i;
+
+    frame_cache_check_size(ws2811);
+    cache = device->cache;
+    if (!cache)
+    {
+        return NULL;
+    }
+
+    // Rebuild the tables that changed, so their generations are current
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        if (ws2811->channel[chan].count)
+        {
+            channel_lut(ws2811, chan);
+        }
+    }
+
+    for (i = 0; i < cache->size; i++)
+    {
+        frame_cache_entry_t *entry = &cache->entries[i];
+
+        if (!entry->last_used || (entry->frame_id != frame_id))
+        {
+            continue;
+        }
+
+        for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+        {
+            ws2811_channel_t *channel = &ws2811->channel[chan];
+
+            if (channel->count &&
+                ((entry->generation[chan] != device->lut[chan].generation) ||
+                 (entry->invert[chan] != ((device->driver_mode != PWM) && channel->invert))))
+            {
+                break;
+            }
+        }
+
+        // Only one entry per frame id, so a stale one means a miss
+        return chan == RPI_PWM_CHANNELS ? entry : NULL;
+    }
+
+    return NULL;
+}
+
+/**
+ * Pick the cache entry to store a frame in: the one already holding that frame
+ * id, an empty one, or the least recently used one.
+ *
+ * @param    ws2811    ws2811 instance pointer.
+ * @param    frame_id  Identity of the frame.
+ *
+ * @returns  Cache entry with a buffer, or NULL if out of memory.
+ */
+static frame_cache_entry_t *frame_cache_replace(ws2811_t *ws2811, uint64_t frame_id)
+{
+    ws2811_device_t *device = ws2811->device;
+    frame_cache_t *cache;
+    frame_cache_entry_t *victim = NULL;
+    int i;
+
+    frame_cache_check_size(ws2811);
+    cache = device->cache;
+    if (!cache)
+    {
+        cache = calloc(1, sizeof(*cache));
+        if (!cache)
+        {
+            return NULL;
+        }
+
+        cache->entries = calloc(ws2811->frame_cache_size, sizeof(*cache->entries));
+        if (!cache->entries)
+        {
+            free(cache);
+            return NULL;
+        }
+        cache->size = ws2811->frame_cache_size;
+        device->cache = cache;
+    }
+
+    for (i = 0; i < cache->size; i++)
+    {
+        frame_cache_entry_t *entry = &cache->entries[i];
+
+        if (entry->last_used && (entry->frame_id == frame_id))
+        {
+            victim = entry;
+            break;
+        }
+
+        if (!victim || (entry->last_used < victim->last_used))
+        {
+            victim = entry;
+        }
+    }
+
+    if (!victim->buf)
+    {
+        // Zeroed, so the padding the encoder doesn't touch stays zero
+        victim->buf = calloc(1, device->pxl_size);
+        if (!victim->buf)
+        {
+            return NULL;
+        }
+    }
+    victim->last_used = 0;
+
+    return victim;
+}
+
+/**
+ * Free the frame cache.
+ *
+ * @param    device  Device pointer.
+ *
+ * @returns  None
+ */
+static void frame_cache_free(ws2811_device_t *device)
+{
+    frame_cache_t *cache = device->cache;
+    int i;
+
+    if (!cache)
+    {
+        return;
+    }
+
+    for (i = 0; i < cache->size; i++)
+    {
+        free(cache->entries[i].buf);
+    }
+    free(cache->entries);
+    free(cache);
+    device->cache = NULL;
+}
+
+/**
+ * Copy a cached frame into pxl_raw and send it.  The staging buffer, or the SPI
+ * buffer, no longer matches what was sent, so the next ws2811_render() encodes
+ * everything again.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ * @param    entry   Cache entry holding the frame.
+ *
+ * @returns  0 on success, value from ws2811_return_t enum otherwise.
+ */
+static ws2811_return_t frame_cache_send(ws2811_t *ws2811, frame_cache_entry_t *entry)
+{
+    ws2811_device_t *device = ws2811->device;
+    uint64_t start = get_microsecond_timestamp();
+    int chan;
+
+    copy_to_dma(device->pxl_raw, entry->buf, 0, device->pxl_size / sizeof(uint32_t));
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        device->shadow[chan].valid = 0;
+    }
+    entry->last_used = ++device->cache->uses;
+
+    ws2811->stats.frames++;
+    ws2811->stats.copy_us += get_microsecond_timestamp() - start;
+
+    return start_transfer(ws2811, frame_protocol_time(ws2811));
+}
+
+// Part of a frame rendered as runs: LED data sent once, or one pattern repeated
+typedef struct run_segment {
+    int offset;             /* Byte offset in the DMA buffer */
+    int bytes;              /* Bytes sent, or the size of the pattern */
+    int reps;               /* Times the pattern is sent, 0 for data sent once */
+} run_segment_t;
+
+// Frame being rendered by ws2811_render_runs()
+typedef struct run_frame {
+    run_segment_t segments[DMA_RUN_CBS];
+    int count;              /* Segments used */
+    int cbs;                /* Control blocks the segments need */
+    int linear;             /* Repeats are copied out, the regular control blocks send the frame */
+} run_frame_t;
+
+/**
+ * Write a repeated pattern out in full, for when the frame can't be sent with 2D
+ * mode.  The first copy is already in place.
+ *
+ * @param    device   Device pointer.
+ * @param    segment  Repeated pattern.
+ * @param    pattern  Cached copy of the pattern, NULL to read it back from the DMA buffer.
+ *
+ * @returns  None
+ */
+static void run_replicate(ws2811_device_t *device, run_segment_t *segment, const uint8_t *pattern)
+{
+    int rep;
+
+    if (!pattern)
+    {
+        pattern = (const uint8_t *)device->pxl_raw + segment->offset;
+    }
+
+    for (rep = 1; rep < segment->reps; rep++)
+    {
+        copy_to_dma(device->pxl_raw + segment->offset + (rep * segment->bytes), pattern, 0,
+                    segment->bytes / sizeof(uint32_t));
+    }
+}
+
+/**
+ * Add a segment to a frame rendered as runs.  Once the segments need more control
+ * blocks than there are, or without 2D mode, repeats are written out in full and
+ * the frame is sent like any other.
+ *
+ * @param    device   Device pointer.
+ * @param    frame    Frame being rendered.
+ * @param    pattern  Cached copy of the data at offset.
+ * @param    offset   Byte offset in the DMA buffer.
+ * @param    bytes    Bytes sent, or the size of the pattern.
+ * @param    reps     Times the pattern is sent, 0 for data sent once.
+ *
+ * @returns  None
+ */
+static void run_add(ws2811_device_t *device, run_frame_t *frame, const uint8_t *pattern, int offset, int bytes,
+                    int reps)
+{
+    const int max = device->dma_max_txfr;
+    run_segment_t *last = frame->count ? &frame->segments[frame->count - 1] : NULL;
+    run_segment_t segment = { .offset = offset, .bytes = bytes, .reps = reps };
+    int cbs, i;
+
+    if (!frame->linear)
+    {
+        // Data sent once right after other data only grows that segment
+        if (!reps && last && !last->reps && (last->offset + last->bytes == offset))
+        {
+            cbs = ((last->bytes + bytes + max - 1) / max) - ((last->bytes + max - 1) / max);
+            if (frame->cbs + cbs <= device->dma_run_cb_count)
+            {
+                last->bytes += bytes;
+                frame->cbs += cbs;
+                return;
+            }
+        }
+
+        cbs = reps ? (reps + DMA_MAX_YLENGTH) / (DMA_MAX_YLENGTH + 1) : (bytes + max - 1) / max;
+        if ((frame->count < DMA_RUN_CBS) && (frame->cbs + cbs <= device->dma_run_cb_count))
+        {
+            frame->segments[frame->count++] = segment;
+            frame->cbs += cbs;
+            return;
+        }
+
+        frame->linear = 1;
+        for (i = 0; i < frame->count; i++)
+        {
+            if (frame->segments[i].reps)
+            {
+                run_replicate(device, &frame->segments[i], NULL);
+            }
+        }
+    }
+
+    if (reps)
+    {
+        run_replicate(device, &segment, pattern);
+    }
+}
+
+/**
+ * Link the control blocks sending a frame rendered as runs into the run chain of
+ * the idle buffer.  Repeats use 2D mode, with a negative source stride going back
+ * to the start of the pattern after every row.
+ *
+ * @param    device  Device pointer.
+ * @param    frame   Frame rendered as runs.
+ *
+ * @returns  Bus address of the first control block.
+ */
+static uint32_t run_chain(ws2811_device_t *device, run_frame_t *frame)
+{
+    volatile dma_cb_t *dma_cb = device->dma_cb_run[device->buf_index];
+    uint32_t dma_cb_ad = addr_to_bus(device, dma_cb);
+    uint32_t source_ad = addr_to_bus(device, device->pxl_raw);
+    int i, used = 0;
+
+    for (i = 0; i < frame->count; i++)
+    {
+        run_segment_t *segment = &frame->segments[i];
+        int reps = segment->reps;
+
+        if (!reps)
+        {
+            // Long segments take several blocks, the next segment starts after all of them
+            int count = (segment->bytes + device->dma_max_txfr - 1) / device->dma_max_txfr;
+
+            used += build_dma_chain(device, &dma_cb[used], dma_cb_ad + (used * sizeof(dma_cb_t)),
+                                    source_ad + segment->offset, 1, segment->bytes,
+                                    dma_cb_ad + ((used + count) * sizeof(dma_cb_t)));
+            continue;
+        }
+
+        while (reps)
+        {
+            int rows = reps > DMA_MAX_YLENGTH + 1 ? DMA_MAX_YLENGTH + 1 : reps;
+
+            dma_cb[used].ti = device->dma_ti | RPI_DMA_TI_SRC_INC | RPI_DMA_TI_TDMODE;
+            dma_cb[used].source_ad = source_ad + segment->offset;
+            dma_cb[used].dest_ad = device->dma_dest_ad;
+            dma_cb[used].txfr_len = RPI_DMA_TXFR_LEN_YLENGTH((rows - 1)) |
+                                    RPI_DMA_TXFR_LEN_XLENGTH(segment->bytes);
+            dma_cb[used].stride = RPI_DMA_STRIDE_S_STRIDE((-segment->bytes));
+            dma_cb[used].nextconbk = dma_cb_ad + ((used + 1) * sizeof(dma_cb_t));
+            used++;
+            reps -= rows;
+        }
+    }
+
+    // The last block goes on to the reset time like the regular chains
+    dma_cb[used - 1].nextconbk = addr_to_bus(device, device->dma_cb_reset);
+
+    return dma_cb_ad;
+}
+
+/**
+ * Time it takes to send part of the wire stream, at 3 symbols per bit.  PWM sends
+ * both channels at the same time.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ * @param    bytes   Bytes of the wire stream.
+ *
+ * @returns  Time in microseconds.
+ */
+static uint64_t wire_time_us(ws2811_t *ws2811, uint64_t bytes)
+{
+    uint64_t time_us = (bytes * 8 * 1000000) / (ws2811->freq * 3);
+
+    if (ws2811->device->driver_mode == PWM)
+    {
+        time_us /= RPI_PWM_CHANNELS;
+    }
+
+    return time_us;
+}
+
+/**
+ * Size the wire stream of a frame in the layout of the driver mode: pxl_size bytes
+ * of LED data followed by the reset time, dma_bytes in total.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  None
+ */
+static void frame_layout(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+
+    switch (device->driver_mode) {
+    case PWM:
+        device->pxl_size = PWM_BYTE_COUNT(device->chan_bytes);
+        device->dma_bytes = device->pxl_size + PWM_RESET_BYTE_COUNT(ws2811->freq);
+        break;
+
+    case PCM:
+        device->pxl_size = PCM_BYTE_COUNT(device->chan_bytes);
+        device->dma_bytes = device->pxl_size + PCM_RESET_BYTE_COUNT(ws2811->freq);
+        break;
+
+    case SPI:
+        // The SPI buffer holds the reset time as well
+        device->pxl_size = SPI_BYTE_COUNT(device->chan_bytes, ws2811->freq);
+        device->dma_bytes = device->pxl_size;
+        break;
+    }
+
+    device->dma_time_us = wire_time_us(ws2811, device->dma_bytes);
+}
+
+/**
+ * Allocate the DMA buffers and control blocks, map the registers and set up the
+ * GPIO pins, the part of initialization the PWM and PCM backends share.  The
+ * memory is released by ws2811_cleanup().
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  0 on success, value from ws2811_return_t enum otherwise.
+ */
+static ws2811_return_t dma_init(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+    ws2811_return_t ret;
+    int buf, i;
+
+    // Frames larger than one control block can transfer are sent by a chain of them
+    device->dma_max_txfr = dmanum_max_txfr(ws2811->dmanum);
+    device->dma_cb_count = (device->pxl_size + device->dma_max_txfr - 1) / device->dma_max_txfr;
+    device->dma_reset_cb_count = ((device->dma_bytes - device->pxl_size) + device->dma_max_txfr - 1) /
+                                 device->dma_max_txfr;
+
+    // Runs of one colour are repeated with 2D mode, which the DMA Lite engines don't have
+    device->dma_run_cb_count = dmanum_is_lite(ws2811->dmanum) ? 0 : DMA_RUN_CBS;
+
+    device->mbox.size = (sizeof(dma_cb_t) * (((device->dma_cb_count + device->dma_run_cb_count) * DMA_BUFFERS) +
+                                             device->dma_reset_cb_count)) +
+                        DMA_ZERO_BYTES + (device->pxl_size * DMA_BUFFERS);
+
+    ret = dma_mem_alloc(ws2811, &device->mbox);
+    if (ret != WS2811_SUCCESS)
+    {
+        return ret;
+    }
+
+    // Control blocks first to keep them 32 byte aligned, then the zero block and the pixel buffers
+    device->dma_cb_reset = (dma_cb_t *)device->mbox.virt_addr + (device->dma_cb_count * DMA_BUFFERS);
+    memset((dma_cb_t *)device->dma_cb_reset, 0, sizeof(dma_cb_t) * device->dma_reset_cb_count);
+    device->dma_zero = (uint32_t *)(device->dma_cb_reset + device->dma_reset_cb_count +
+                                    (device->dma_run_cb_count * DMA_BUFFERS));
+    memset((uint32_t *)device->dma_zero, 0, DMA_ZERO_BYTES);
+
+    for (buf = 0; buf < DMA_BUFFERS; buf++)
+    {
+        volatile uint32_t *pxl_words;
+
+        device->dma_cb_buf[buf] = (dma_cb_t *)device->mbox.virt_addr + (device->dma_cb_count * buf);
+        device->dma_cb_run[buf] = device->dma_cb_reset + device->dma_reset_cb_count +
+                                  (device->dma_run_cb_count * buf);
+        device->pxl_buf[buf] = (uint8_t *)device->dma_zero + DMA_ZERO_BYTES + (device->pxl_size * buf);
+
+        // All zeros, PWM inverts in hardware and PCM when encoding
+        pxl_words = (volatile uint32_t *)device->pxl_buf[buf];
+        for (i = 0; i < device->pxl_size / (int)sizeof(uint32_t); i++)
+        {
+            pxl_words[i] = 0x0;
+        }
+
+        memset((dma_cb_t *)device->dma_cb_buf[buf], 0, sizeof(dma_cb_t) * device->dma_cb_count);
+
+        // Cache the DMA control block bus address
+        device->dma_cb_buf_addr[buf] = addr_to_bus(device, device->dma_cb_buf[buf]);
+    }
+    select_dma_buffer(device, 0);
+
+    // Allocate the cached staging buffer, a zeroed mirror of the freshly initialized DMA buffer
+    device->pxl_stage = malloc(device->pxl_size);
+    if (!device->pxl_stage)
+    {
+        return WS2811_ERROR_OUT_OF_MEMORY;
+    }
+    memset(device->pxl_stage, 0, device->pxl_size);
+
+    // Map the physical registers into userspace
+    if (map_registers(ws2811))
+    {
+        unmap_registers(ws2811);
+        return WS2811_ERROR_MAP_REGISTERS;
+    }
+
+    // Initialize the GPIO pins
+    if (gpio_init(ws2811))
+    {
+        unmap_registers(ws2811);
+        return WS2811_ERROR_GPIO_INIT;
+    }
+
+    return WS2811_SUCCESS;
+}
+
+/**
+ * Set up the PWM backend.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  0 on success, value from ws2811_return_t enum otherwise.
+ */
+static ws2811_return_t pwm_init(ws2811_t *ws2811)
+{
+    ws2811_return_t ret = dma_init(ws2811);
+
+    if (ret != WS2811_SUCCESS)
+    {
+        return ret;
+    }
+
+    // Setup the PWM, clocks, and DMA
+    if (setup_pwm(ws2811))
+    {
+        unmap_registers(ws2811);
+        return WS2811_ERROR_PWM_SETUP;
+    }
+
+    return WS2811_SUCCESS;
+}
+
+/**
+ * Set up the PCM backend.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  0 on success, value from ws2811_return_t enum otherwise.
+ */
+static ws2811_return_t pcm_init(ws2811_t *ws2811)
+{
+    ws2811_return_t ret = dma_init(ws2811);
+
+    if (ret != WS2811_SUCCESS)
+    {
+        return ret;
+    }
+
+    // Setup the PCM, clock, and DMA
+    if (setup_pcm(ws2811))
+    {
+        unmap_registers(ws2811);
+        return WS2811_ERROR_PCM_SETUP;
+    }
+
+    return WS2811_SUCCESS;
+}
+
+/**
+ * Stop the PWM backend.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  None
+ */
+static void pwm_fini(ws2811_t *ws2811)
+{
+    stop_pwm(ws2811);
+    unmap_registers(ws2811);
+}
+
+/**
+ * Stop the PCM backend once its FIFO has run empty.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  None
+ */
+static void pcm_fini(ws2811_t *ws2811)
+{
+    volatile pcm_t *pcm = ws2811->device->pcm;
+
+    while (!(pcm->cs & RPI_PCM_CS_TXE)) ;    // Wait till TX FIFO is empty
+    stop_pcm(ws2811);
+    unmap_registers(ws2811);
+}
+
+/**
+ * Write all of a buffer to a file descriptor.
+ *
+ * @param    fd    File descriptor.
+ * @param    data  Data to write.
+ * @param    size  Size of data in bytes.
+ *
+ * @returns  0 on success, -1 on error.
+ */
+static int write_all(int fd, const void *data, size_t size)
+{
+    const uint8_t *pos = data;
+
+    while (size)
+    {
+        ssize_t written = write(fd, pos, size);
+
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+
+        pos += written;
+        size -= written;
+    }
+
+    return 0;
+}
+
+/**
+ * Set up the capture backend.  pxl_raw is plain memory holding the wire stream of
+ * a frame, the LED data followed by the zeros of the reset time.  No hardware is
+ * touched.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  0 on success, value from ws2811_return_t enum otherwise.
+ */
+static ws2811_return_t capture_init(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+    ws2811_capture_t *capture = &ws2811->capture;
+
+    device->capture_buf = calloc(1, device->dma_bytes);
+    if (!device->capture_buf)
+    {
+        return WS2811_ERROR_OUT_OF_MEMORY;
+    }
+    device->pxl_raw = device->capture_buf;
+    device->simulated = !capture->realtime;
+
+    // PWM and PCM render through a staging buffer like on the hardware, so a
+    // capture runs the same code.  SPI encodes straight into its buffer.
+    if (device->driver_mode != SPI)
+    {
+        device->pxl_stage = calloc(1, device->pxl_size);
+        if (!device->pxl_stage)
+        {
+            return WS2811_ERROR_OUT_OF_MEMORY;
+        }
+    }
+
+    if (capture->file)
+    {
+        int fd = open(capture->file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+        if (fd < 0)
+        {
+            fprintf(stderr, "Cannot open capture file %s\n", capture->file);
+            return WS2811_ERROR_CAPTURE;
+        }
+        device->capture_fd = fd;
+    }
+
+    capture->frame = device->capture_buf;
+    capture->frame_bytes = device->dma_bytes;
+    capture->frame_start_us = 0;
+    capture->frames = 0;
+
+    return WS2811_SUCCESS;
+}
+
+/**
+ * Take the frame in pxl_raw as sent.  It starts right after the previous frame and
+ * its reset wait on the simulated clock, or now in real time.  With a capture file
+ * it is appended there, after a ws2811_capture_header_t.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  0 on success, value from ws2811_return_t enum otherwise.
+ */
+static ws2811_return_t capture_start(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+    ws2811_capture_t *capture = &ws2811->capture;
+    const uint64_t now = get_microsecond_timestamp();
+
+    if (!device->simulated)
+    {
+        capture->frame_start_us = now;
+        device->dma_done_us = now + device->dma_time_us;
+    }
+    else if (capture->frames)
+    {
+        // render_wait_time still holds the time the previous frame needed
+        capture->frame_start_us += ws2811->render_wait_time;
+    }
+    capture->frames++;
+
+    if (device->capture_fd > 0)
+    {
+        // The SPI buffer holds the reset time too, data_bytes is only the LED data
+        ws2811_capture_header_t header = {
+            .magic = WS2811_CAPTURE_MAGIC,
+            .layout = device->driver_mode,
+            .freq = ws2811->freq,
+            .data_bytes = device->driver_mode == SPI ? device->chan_bytes : device->pxl_size,
+            .bytes = device->dma_bytes,
+            .start_us = capture->frame_start_us,
+        };
+
+        if (write_all(device->capture_fd, &header, sizeof(header)) ||
+            write_all(device->capture_fd, device->capture_buf, device->dma_bytes))
+        {
+            return WS2811_ERROR_CAPTURE;
+        }
+    }
+
+    return WS2811_SUCCESS;
+}
+
+/**
+ * Wait as long as sending the captured frame would have taken, only when
+ * capturing in real time.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  0
+ */
+static ws2811_return_t capture_wait(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+    const uint64_t now = get_microsecond_timestamp();
+
+    if (!device->simulated && (device->dma_done_us > now))
+    {
+        usleep(device->dma_done_us - now);
+    }
+
+    return WS2811_SUCCESS;
+}
+
+/**
+ * Nothing to stop for the capture backend, ws2811_cleanup() closes the capture
+ * file and frees the buffer.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  None
+ */
+static void capture_fini(ws2811_t *ws2811)
+{
+    (void)ws2811;
+}
+
+static const ws2811_backend_t hw_backends[] =
+{
+    {
+        .driver_mode = PWM,
+        .layout = ENCODE_LAYOUT_PWM,
+        .dma = 1,
+        .init = pwm_init,
+        .start = dma_start,
+        .wait = dma_wait,
+        .fini = pwm_fini,
+    },
+    {
+        .driver_mode = PCM,
+        .layout = ENCODE_LAYOUT_PCM,
+        .dma = 1,
+        .init = pcm_init,
+        .start = dma_start,
+        .wait = dma_wait,
+        .fini = pcm_fini,
+    },
+    {
+        .driver_mode = SPI,
+        .layout = ENCODE_LAYOUT_SPI,
+        .init = spi_init,
+        .start = spi_transfer,
+        .wait = spi_wait,
+        .fini = spi_fini,
+    },
+};
+
+static const ws2811_backend_t capture_backends[] =
+{
+    {
+        .driver_mode = PWM,
+        .layout = ENCODE_LAYOUT_PWM,
+        .init = capture_init,
+        .start = capture_start,
+        .wait = capture_wait,
+        .fini = capture_fini,
+    },
+    {
+        .driver_mode = PCM,
+        .layout = ENCODE_LAYOUT_PCM,
+        .init = capture_init,
+        .start = capture_start,
+        .wait = capture_wait,
+        .fini = capture_fini,
+    },
+    {
+        .driver_mode = SPI,
+        .layout = ENCODE_LAYOUT_SPI,
+        .init = capture_init,
+        .start = capture_start,
+        .wait = capture_wait,
+        .fini = capture_fini,
+    },
+};
+
+/**
+ * Find the backend for the driver mode, the hardware one or the capture one.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  Backend, NULL if there is none for the driver mode.
+ */
+static const ws2811_backend_t *select_backend(ws2811_t *ws2811)
+{
+    const ws2811_backend_t *backends = ws2811->capture.enabled ? capture_backends : hw_backends;
+    int i;
+
+    for (i = 0; i < (int)(sizeof(hw_backends) / sizeof(hw_backends[0])); i++)
+    {
+        if (backends[i].driver_mode == ws2811->device->driver_mode)
+        {
+            return &backends[i];
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ *
+ * Application API Functions
+ *
+ */
+
+
+/**
+ * Allocate and initialize memory, buffers, pages, PWM, DMA, and GPIO.  With
+ * ws2811->capture.enabled set, frames are captured instead and no hardware is
+ * needed.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  0 on success, -1 otherwise.
+ */
+ws2811_return_t ws2811_init(ws2811_t *ws2811)
+{
+    ws2811_device_t *device;
+    int chan;
+    ws2811_return_t ret;
+
+    ws2811->rpi_hw = NULL;
+    if (!ws2811->capture.enabled)
+    {
+        ws2811->rpi_hw = rpi_hw_detect();
+        if (!ws2811->rpi_hw)
+        {
+            return WS2811_ERROR_HW_NOT_SUPPORTED;
+        }
+    }
+
+    ws2811->device = malloc(sizeof(*ws2811->device));
+    if (!ws2811->device)
+    {
+        return WS2811_ERROR_OUT_OF_MEMORY;
+    }
+    memset(ws2811->device, 0, sizeof(*ws2811->device));
+    device = ws2811->device;
+    device->mbox.handle = -1;
+
+    if (!ws2811->capture.enabled)
+    {
+        if (check_hwver_and_gpionum(ws2811) < 0)
+        {
+            return WS2811_ERROR_ILLEGAL_GPIO;
+        }
+    }
+    else if (!ws2811->channel[0].count && ws2811->channel[1].count)
+    {
+        device->driver_mode = PWM;  // Channel 1 only, on PWM1
+    }
+    else if (set_driver_mode(ws2811, ws2811->channel[0].gpionum) < 0)
+    {
+        // No hardware to check, the GPIO only picks the wire format to capture
+        return WS2811_ERROR_ILLEGAL_GPIO;
+    }
+    device->backend = select_backend(ws2811);
+
+    device->max_count = max_channel_led_count(ws2811);
+    device->chan_bytes = max_channel_byte_count(ws2811);
+    frame_layout(ws2811);
+
+    // Encoder threads are started once and woken for every frame
+    encode_pool_start(ws2811);
+
+    // Allocate the LED buffers
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        ws2811_channel_t *channel = &ws2811->channel[chan];
+
+        channel->leds = malloc(sizeof(ws2811_led_t) * channel->count);
+        if (!channel->leds)
+        {
+            ws2811_cleanup(ws2811);
+            return WS2811_ERROR_OUT_OF_MEMORY;
+        }
+
+        memset(channel->leds, 0, sizeof(ws2811_led_t) * channel->count);
+
+        device->shadow[chan].leds = malloc(sizeof(ws2811_led_t) * channel->count);
+        if (!device->shadow[chan].leds)
+        {
+            ws2811_cleanup(ws2811);
+            return WS2811_ERROR_OUT_OF_MEMORY;
+        }
+
+        if (!channel->strip_type)
+        {
+          channel->strip_type=WS2811_STRIP_RGB;
+        }
+
+        // Set default uncorrected gamma table
+        if (!channel->gamma)
+        {
+          channel->gamma = malloc(sizeof(uint8_t) * 256);
+          int x;
+          for(x = 0; x < 256; x++){
+            channel->gamma[x] = x;
+          }
+        }
+
+        channel->wshift = (channel->strip_type >> 24) & 0xff;
+        channel->rshift = (channel->strip_type >> 16) & 0xff;
+        channel->gshift = (channel->strip_type >> 8)  & 0xff;
+        channel->bshift = (channel->strip_type >> 0)  & 0xff;
+
+        select_kernels(ws2811, chan);
+    }
+
+    // Buffers and hardware of the driver mode
+    ret = device->backend->init(ws2811);
+    if (ret != WS2811_SUCCESS)
+    {
+        ws2811_cleanup(ws2811);
+        return ret;
+    }
+
+    // Frames from ws2811_submit() are sent by a thread of their own
+    ret = frame_queue_start(ws2811);
+    if (ret != WS2811_SUCCESS)
+    {
+        device->backend->fini(ws2811);
+        ws2811_cleanup(ws2811);
+    }
+
+    return ret;
+}
+
+/**
+ * Shut down DMA, PWM, and cleanup memory.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  None
+ */
+void ws2811_fini(ws2811_t *ws2811)
+{
+    frame_queue_stop(ws2811->device);
+    ws2811_loop_stop(ws2811);
+    ws2811_wait(ws2811);
+    ws2811->device->backend->fini(ws2811);
+
+    ws2811_cleanup(ws2811);
+}
+
+/**
+ * Wait for any executing DMA operation to complete before returning.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  0 on success, -1 on DMA competion error
+ */
+ws2811_return_t ws2811_wait(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
 
-    ws2811->device = malloc(sizeof(*ws2811->device));
-    if (!ws2811->device)
+    if (device->loop)  // A frame loop never finishes
     {
-        return WS2811_ERROR_OUT_OF_MEMORY;
+        return WS2811_SUCCESS;
     }
-    memset(ws2811->device, 0, sizeof(*ws2811->device));
-    device = ws2811->device;
 
-    if (check_hwver_and_gpionum(ws2811) < 0)
+    return device->backend->wait(ws2811);
+}
+
+/**
+ * Get a file descriptor that becomes readable when the next frame can be sent
+ * without ws2811_render() having to wait, for use with poll() or epoll.  It is
+ * a timerfd: read its 8 byte expiration count to clear it.  Each render re-arms
+ * it.  The descriptor is owned by the driver and closed by ws2811_fini().
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  File descriptor, or -1 if it couldn't be created.
+ */
+int ws2811_get_completion_fd(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+
+    if (device->completion_fd <= 0)
     {
-        return WS2811_ERROR_ILLEGAL_GPIO;
-    }
+        int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
 
-    device->max_count = max_channel_led_count(ws2811);
+        if (fd < 0)
+        {
+            return -1;
+        }
 
-    if (device->driver_mode == SPI) {
-        return spi_init(ws2811);
+        device->completion_fd = fd;
+        arm_completion_fd(device);
     }
 
-    // Determine how much physical memory we need for DMA
-    switch (device->driver_mode) {
-    case PWM:
-        device->mbox.size = PWM_BYTE_COUNT(device->max_count, ws2811->freq) +
-                            sizeof(dma_cb_t);
-        break;
+    return device->completion_fd;
+}
 
-    case PCM:
-        device->mbox.size = PCM_BYTE_COUNT(device->max_count, ws2811->freq) +
-                            sizeof(dma_cb_t);
-        break;
-    }
-    // Round up to page size multiple
-    device->mbox.size = (device->mbox.size + (PAGE_SIZE - 1)) & ~(PAGE_SIZE - 1);
+/**
+ * Render the DMA buffer from the user supplied LED arrays and start the DMA
+ * controller.  This will update all LEDs on both PWM channels.  The frame is
+ * rendered into the idle DMA buffer, only starting the transfer waits for the
+ * previous one to finish.  With ws2811->skip_unchanged set, a frame identical to
+ * the one last sent is neither encoded nor sent, unless ws2811->keepalive_us has
+ * passed since.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  None
+ */
+ws2811_return_t  ws2811_render(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+    int driver_mode = device->driver_mode;
+    int staged = device->pxl_stage && !ws2811->render_direct;
+    encode_job_t job = { .pxl = staged ? device->pxl_stage : device->pxl_raw };
+    encode_result_t result;
+    int chan, buf;
+    int span_lo, span_hi;
+    uint32_t protocol_time = 0;
+    ws2811_return_t ret;
+    uint64_t start;
 
-    device->mbox.handle = mbox_open();
-    if (device->mbox.handle == -1)
-    {
-        return WS2811_ERROR_MAILBOX_DEVICE;
-    }
+    start = get_microsecond_timestamp();
 
-    device->mbox.mem_ref = mem_alloc(device->mbox.handle, device->mbox.size, PAGE_SIZE,
-                                     rpi_hw->videocore_base == 0x40000000 ? 0xC : 0x4);
-    if (device->mbox.mem_ref == 0)
+    // The strip holds on to the last frame, so only send it again to keep it alive
+    if (ws2811->skip_unchanged && frame_unchanged(ws2811) &&
+        (!ws2811->keepalive_us || ((start - device->previous_timestamp) < ws2811->keepalive_us)))
     {
-        return WS2811_ERROR_OUT_OF_MEMORY;
+        ws2811->stats.frames_skipped++;
+        return WS2811_SUCCESS;
     }
 
-    device->mbox.bus_addr = mem_lock(device->mbox.handle, device->mbox.mem_ref);
-    if (device->mbox.bus_addr == (uint32_t) ~0UL)
-    {
-       mem_free(device->mbox.handle, device->mbox.size);
-       return WS2811_ERROR_MEM_LOCK;
-    }
+    // The staging buffer and the SPI buffer keep their contents between frames, so only
+    // LEDs that changed need to be encoded again.  The DMA buffers take turns and don't.
+    job.incremental = staged || !device->backend->dma;
 
-    device->mbox.virt_addr = mapmem(BUS_TO_PHYS(device->mbox.bus_addr), device->mbox.size, DEV_MEM);
-    if (!device->mbox.virt_addr)
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)         // Channel
     {
-        mem_unlock(device->mbox.handle, device->mbox.mem_ref);
-        mem_free(device->mbox.handle, device->mbox.size);
+        ws2811_channel_t *channel = &ws2811->channel[chan];
+        channel_shadow_t *shadow = &device->shadow[chan];
+        const int invert = (driver_mode != PWM) && channel->invert;
 
-        ws2811_cleanup(ws2811);
-        return WS2811_ERROR_MMAP;
-    }
+        if (!channel->count)
+        {
+            continue;
+        }
 
-    // Initialize all pointers to NULL.  Any non-NULL pointers will be freed on cleanup.
-    device->pxl_raw = NULL;
-    device->dma_cb = NULL;
-    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
-    {
-        ws2811->channel[chan].leds = NULL;
+        // Rebuilding the table invalidates the shadow copy, so do that first
+        job.lut[chan] = channel_lut(ws2811, chan);
+        job.leds[chan] = channel->leds;
+        job.full[chan] = !job.incremental || !shadow->valid || (shadow->invert != invert);
     }
 
-    // Allocate the LED buffers
+    job.paired = pwm_pair_ready(ws2811, job.incremental);
+    protocol_time = frame_protocol_time(ws2811);
+
+    encode_run(ws2811, &job, &result);
+    span_lo = result.span_lo;
+    span_hi = result.span_hi;
+
     for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
     {
         ws2811_channel_t *channel = &ws2811->channel[chan];
 
-        channel->leds = malloc(sizeof(ws2811_led_t) * channel->count);
-        if (!channel->leds)
+        if (!channel->count)
         {
-            ws2811_cleanup(ws2811);
-            return WS2811_ERROR_OUT_OF_MEMORY;
+            continue;
         }
 
-        memset(channel->leds, 0, sizeof(ws2811_led_t) * channel->count);
+        device->shadow[chan].valid = job.incremental;
+        device->shadow[chan].invert = (driver_mode != PWM) && channel->invert;
+        device->shadow[chan].generation = device->lut[chan].generation;
+        ws2811->stats.leds_skipped += channel->count - result.encoded[chan];
+    }
 
-        if (!channel->strip_type)
+    ws2811->stats.frames++;
+    ws2811->stats.encode_us += get_microsecond_timestamp() - start;
+
+    // pxl_raw is the idle buffer, so it can be filled while the previous frame is still
+    // being transmitted from the other one.  It needs what changed in this frame, plus
+    // what changed in the previous one, which only went to the other buffer.
+    if (staged)
+    {
+        int cur = device->buf_index;
+
+        for (buf = 0; buf < DMA_BUFFERS; buf++)
         {
-          channel->strip_type=WS2811_STRIP_RGB;
+            span_add(&device->pending_lo[buf], &device->pending_hi[buf], span_lo, span_hi);
         }
 
-        // Set default uncorrected gamma table
-        if (!channel->gamma)
+        start = get_microsecond_timestamp();
+        if (device->pending_lo[cur] < device->pending_hi[cur])
         {
-          channel->gamma = malloc(sizeof(uint8_t) * 256);
-          int x;
-          for(x = 0; x < 256; x++){
-            channel->gamma[x] = x;
-          }
+            copy_to_dma(device->pxl_raw, device->pxl_stage, device->pending_lo[cur], device->pending_hi[cur]);
         }
-
-        channel->wshift = (channel->strip_type >> 24) & 0xff;
-        channel->rshift = (channel->strip_type >> 16) & 0xff;
-        channel->gshift = (channel->strip_type >> 8)  & 0xff;
-        channel->bshift = (channel->strip_type >> 0)  & 0xff;
-
+        device->pending_lo[cur] = device->pending_hi[cur] = 0;
+        ws2811->stats.copy_us += get_microsecond_timestamp() - start;
     }
 
-    device->dma_cb = (dma_cb_t *)device->mbox.virt_addr;
-    device->pxl_raw = (uint8_t *)device->mbox.virt_addr + sizeof(dma_cb_t);
-
-    switch (device->driver_mode) {
-    case PWM:
-       pwm_raw_init(ws2811);
-       break;
+    ret = start_transfer(ws2811, protocol_time);
 
-    case PCM:
-       pcm_raw_init(ws2811);
-       break;
+    if (ws2811->skip_unchanged && (ret == WS2811_SUCCESS))
+    {
+        // Encoding straight into DMA memory doesn't keep the shadow copies up to date
+        for (chan = 0; !job.incremental && (chan < RPI_PWM_CHANNELS); chan++)
+        {
+            memcpy(device->shadow[chan].leds, ws2811->channel[chan].leds,
+                   sizeof(ws2811_led_t) * ws2811->channel[chan].count);
+        }
+        device->sent_valid = 1;
     }
 
-    memset((dma_cb_t *)device->dma_cb, 0, sizeof(dma_cb_t));
+    return ret;
+}
 
-    // Cache the DMA control block bus address
-    device->dma_cb_addr = addr_to_bus(device, device->dma_cb);
+/**
+ * Encode a frame and queue it to be sent at a given time by the driver's queue
+ * thread, so the caller doesn't wait for the previous frame.  Only available
+ * when ws2811->queue_depth was set before ws2811_init().  Blocks while the
+ * queue is full.  Frames must be submitted from a single thread, and not mixed
+ * with ws2811_render().
+ *
+ * When a frame is late and the next one has a time that is already due, it is
+ * dropped and ws2811->frame_dropped is called instead of ws2811->frame_done.
+ * Frames followed by one submitted with a time of 0 are never dropped.  Both
+ * callbacks are called from the queue thread.
+ *
+ * @param    ws2811         ws2811 instance pointer.
+ * @param    leds           LED values per channel, copied before returning.  NULL, or
+ *                          a NULL entry, takes the values from channel[].leds.
+ * @param    present_at_us  CLOCK_MONOTONIC time in microseconds to start sending the
+ *                          frame, or 0 to send it as soon as possible.
+ *
+ * @returns  0 on success, WS2811_ERROR_NO_QUEUE without a queue or once the queue
+ *           is being stopped, value from ws2811_return_t enum otherwise.
+ */
+ws2811_return_t ws2811_submit(ws2811_t *ws2811, const ws2811_led_t *const leds[RPI_PWM_CHANNELS],
+                              uint64_t present_at_us)
+{
+    ws2811_device_t *device = ws2811->device;
+    frame_queue_t *queue = device->queue;
+    encode_result_t result;
+    frame_slot_t *slot;
+    uint64_t start;
 
-    // Map the physical registers into userspace
-    if (map_registers(ws2811))
+    if (!queue)
     {
-        ws2811_cleanup(ws2811);
-        return WS2811_ERROR_MAP_REGISTERS;
+        return WS2811_ERROR_NO_QUEUE;
     }
 
-    // Initialize the GPIO pins
-    if (gpio_init(ws2811))
+    pthread_mutex_lock(&queue->lock);
+    while (!queue->stop && (queue->count == queue->depth))
     {
-        unmap_registers(ws2811);
-        ws2811_cleanup(ws2811);
-        return WS2811_ERROR_GPIO_INIT;
+        pthread_cond_wait(&queue->space, &queue->lock);
     }
-
-    switch (device->driver_mode) {
-    case PWM:
-        // Setup the PWM, clocks, and DMA
-        if (setup_pwm(ws2811))
-        {
-            unmap_registers(ws2811);
-            ws2811_cleanup(ws2811);
-            return WS2811_ERROR_PWM_SETUP;
-        }
-        break;
-    case PCM:
-    // Setup the PCM, clock, and DMA
-        if (setup_pcm(ws2811))
-        {
-            unmap_registers(ws2811);
-            ws2811_cleanup(ws2811);
-            return WS2811_ERROR_PCM_SETUP;
-        }
-        break;
+    // Woken up by ws2811_fini(), the queued frames are being dropped
+    if (queue->stop)
+    {
+        pthread_mutex_unlock(&queue->lock);
+        return WS2811_ERROR_NO_QUEUE;
     }
+    // The only producer, so the slot after the queued frames stays free
+    slot = &queue->slots[(queue->head + queue->count) % queue->depth];
+    pthread_mutex_unlock(&queue->lock);
+
+    start = get_microsecond_timestamp();
+
+    encode_frame(ws2811, leds, slot->buf, &result);
+
+    slot->span_lo = result.span_lo;
+    slot->span_hi = result.span_hi;
+    slot->present_at_us = present_at_us;
+    slot->protocol_time = frame_protocol_time(ws2811);
+
+    ws2811->stats.frames++;
+    ws2811->stats.encode_us += get_microsecond_timestamp() - start;
+
+    pthread_mutex_lock(&queue->lock);
+    queue->count++;
+    pthread_cond_signal(&queue->wake);
+    pthread_mutex_unlock(&queue->lock);
 
     return WS2811_SUCCESS;
 }
 
 /**
- * Shut down DMA, PWM, and cleanup memory.
+ * Send a frame stored earlier by ws2811_render_store() without encoding it again.
+ * Applications that play the same frames over and over try this first and only
+ * fill channel[].leds and call ws2811_render_store() on a miss.  Frames encoded
+ * with a different brightness, gamma table or inversion don't match.
  *
- * @param    ws2811  ws2811 instance pointer.
+ * @param    ws2811    ws2811 instance pointer.
+ * @param    frame_id  Identity of the frame, chosen by the application.
  *
- * @returns  None
+ * @returns  0 on success, WS2811_ERROR_NOT_CACHED if nothing was sent, value from
+ *           ws2811_return_t enum otherwise.
  */
-void ws2811_fini(ws2811_t *ws2811)
+ws2811_return_t ws2811_render_cached(ws2811_t *ws2811, uint64_t frame_id)
 {
-    volatile pcm_t *pcm = ws2811->device->pcm;
+    frame_cache_entry_t *entry = frame_cache_find(ws2811, frame_id);
 
-    ws2811_wait(ws2811);
-    switch (ws2811->device->driver_mode) {
-    case PWM:
-        stop_pwm(ws2811);
-        break;
-    case PCM:
-        while (!(pcm->cs & RPI_PCM_CS_TXE)) ;    // Wait till TX FIFO is empty
-        stop_pcm(ws2811);
-        break;
+    if (!entry)
+    {
+        ws2811->stats.cache_misses++;
+        return WS2811_ERROR_NOT_CACHED;
     }
 
-    unmap_registers(ws2811);
+    ws2811->stats.cache_hits++;
 
-    ws2811_cleanup(ws2811);
+    return frame_cache_send(ws2811, entry);
 }
 
 /**
- * Wait for any executing DMA operation to complete before returning.
+ * Render channel[].leds like ws2811_render(), and keep the encoded frame for
+ * ws2811_render_cached().  Up to ws2811->frame_cache_size frames are kept, the
+ * least recently sent one is replaced when the cache is full.  Changing the size
+ * drops the frames kept so far.  Without a cache size this is ws2811_render().
  *
- * @param    ws2811  ws2811 instance pointer.
+ * @param    ws2811    ws2811 instance pointer.
+ * @param    frame_id  Identity of the frame, chosen by the application.  Storing a
+ *                     frame id again replaces the frame.
  *
- * @returns  0 on success, -1 on DMA competion error
+ * @returns  0 on success, value from ws2811_return_t enum otherwise.
  */
-ws2811_return_t ws2811_wait(ws2811_t *ws2811)
+ws2811_return_t ws2811_render_store(ws2811_t *ws2811, uint64_t frame_id)
 {
-    volatile dma_t *dma = ws2811->device->dma;
+    ws2811_device_t *device = ws2811->device;
+    frame_cache_entry_t *entry;
+    encode_result_t result;
+    uint64_t start;
+    int chan;
 
-    if (ws2811->device->driver_mode == SPI)  // Nothing to do for SPI
+    if (ws2811->frame_cache_size <= 0)
     {
-        return WS2811_SUCCESS;
+        return ws2811_render(ws2811);
     }
 
-    while ((dma->cs & RPI_DMA_CS_ACTIVE) &&
-           !(dma->cs & RPI_DMA_CS_ERROR))
+    entry = frame_cache_replace(ws2811, frame_id);
+    if (!entry)
     {
-        usleep(10);
+        return WS2811_ERROR_OUT_OF_MEMORY;
     }
 
-    if (dma->cs & RPI_DMA_CS_ERROR)
+    start = get_microsecond_timestamp();
+    encode_frame(ws2811, NULL, entry->buf, &result);
+    ws2811->stats.encode_us += get_microsecond_timestamp() - start;
+
+    entry->frame_id = frame_id;
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
     {
-        fprintf(stderr, "DMA Error: %08x\n", dma->debug);
-        return WS2811_ERROR_DMA;
+        entry->generation[chan] = device->lut[chan].generation;
+        entry->invert[chan] = (device->driver_mode != PWM) && ws2811->channel[chan].invert;
     }
 
-    return WS2811_SUCCESS;
+    return frame_cache_send(ws2811, entry);
 }
 
 /**
- * Render the DMA buffer from the user supplied LED arrays and start the DMA
- * controller.  This will update all LEDs on both PWM channels.
+ * Send channel 0 described as runs of LEDs with the same value, such as solid
+ * fills or large uniform regions.  Every run is encoded once, and on a full DMA
+ * channel (0 to 6) sent by a 2D mode control block repeating it, so the work
+ * depends on the number of runs rather than the number of LEDs.  The DMA Lite
+ * channels, SPI and capture copy the encoded run out instead.  channel[0].leds is not
+ * updated.  In PWM mode channel 1 must be unused.
  *
- * @param    ws2811  ws2811 instance pointer.
+ * @param    ws2811     ws2811 instance pointer.
+ * @param    runs       Runs of LED values, covering channel[0].count LEDs.
+ * @param    run_count  Number of runs.
  *
- * @returns  None
+ * @returns  0 on success, value from ws2811_return_t enum otherwise.
  */
-ws2811_return_t  ws2811_render(ws2811_t *ws2811)
+ws2811_return_t ws2811_render_runs(ws2811_t *ws2811, const ws2811_run_t *runs, int run_count)
 {
-	static uint8_t convert_table[3][256] =
-	{ 
-		{
-			0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92,  
-			0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 
-			0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x93, 0x93, 0x93, 
-			0x93, 0x93, 0x93, 0x93, 0x93, 0x93, 0x93, 0x93, 0x93, 0x93, 0x93, 0x93, 0x93, 
-			0x93, 0x93, 0x93, 0x93, 0x93, 0x93, 0x93, 0x93, 0x93, 0x93, 0x93, 0x93, 0x93, 
-			0x93, 0x93, 0x93, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 
-			0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 
-			0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9B, 0x9B, 0x9B, 0x9B, 
-			0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 
-			0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 
-			0x9B, 0x9B, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 
-			0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 
-			0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 
-			0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 
-			0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 
-			0xD3, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 
-			0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 
-			0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 
-			0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 
-			0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB 
-		},
-		{		 
-			0x49, 0x49, 0x49, 0x49, 0x49, 0x49, 0x49, 0x49, 0x4D, 
-			0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x69, 0x69, 0x69, 0x69, 0x69, 0x69, 
-			0x69, 0x69, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x49, 0x49, 0x49, 
-			0x49, 0x49, 0x49, 0x49, 0x49, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 
-			0x69, 0x69, 0x69, 0x69, 0x69, 0x69, 0x69, 0x69, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 
-			0x6D, 0x6D, 0x6D, 0x49, 0x49, 0x49, 0x49, 0x49, 0x49, 0x49, 0x49, 0x4D, 0x4D, 
-			0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x69, 0x69, 0x69, 0x69, 0x69, 0x69, 0x69, 
-			0x69, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x49, 0x49, 0x49, 0x49, 
-			0x49, 0x49, 0x49, 0x49, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x69, 
-			0x69, 0x69, 0x69, 0x69, 0x69, 0x69, 0x69, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 
-			0x6D, 0x6D, 0x49, 0x49, 0x49, 0x49, 0x49, 0x49, 0x49, 0x49, 0x4D, 0x4D, 0x4D, 
-			0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x69, 0x69, 0x69, 0x69, 0x69, 0x69, 0x69, 0x69, 
-			0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x49, 0x49, 0x49, 0x49, 0x49, 
-			0x49, 0x49, 0x49, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x69, 0x69, 
-			0x69, 0x69, 0x69, 0x69, 0x69, 0x69, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 
-			0x6D, 0x49, 0x49, 0x49, 0x49, 0x49, 0x49, 0x49, 0x49, 0x4D, 0x4D, 0x4D, 0x4D, 
-			0x4D, 0x4D, 0x4D, 0x4D, 0x69, 0x69, 0x69, 0x69, 0x69, 0x69, 0x69, 0x69, 0x6D, 
-			0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x49, 0x49, 0x49, 0x49, 0x49, 0x49, 
-			0x49, 0x49, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x69, 0x69, 0x69, 
-			0x69, 0x69, 0x69, 0x69, 0x69, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D 		
-		},		
-		{
-			0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 
-			0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 
-			0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 
-			0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 
-			0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 
-			0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 
-			0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 
-			0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 
-			0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 
-			0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 
-			0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 
-			0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 
-			0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 
-			0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 
-			0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 
-			0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 
-			0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 
-			0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 
-			0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 
-			0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6 
-		}
-	};
-
-    volatile uint8_t *pxl_raw = ws2811->device->pxl_raw;
-    int driver_mode = ws2811->device->driver_mode;
-    int i, l, chan;
-    unsigned j;
-    ws2811_return_t ret = WS2811_SUCCESS;
-    uint32_t protocol_time = 0;
-    static uint64_t previous_timestamp = 0;
+    ws2811_device_t *device = ws2811->device;
+    ws2811_channel_t *channel = &ws2811->channel[0];
+    const int stride = device->driver_mode == PWM ? RPI_PWM_CHANNELS : 1;
+    const int group_bytes = RUN_GROUP_LEDS * channel_colours(channel) * ENCODE_BYTES_PER_COLOUR * stride;
+    const uint8_t *lut;
+    run_frame_t frame = { .count = 0 };
+    uint32_t scratch[(RUN_GROUP_LEDS * 4 * ENCODE_BYTES_PER_COLOUR * RPI_PWM_CHANNELS) / sizeof(uint32_t)];
+    ws2811_led_t group[RUN_GROUP_LEDS];
+    int run = 0, left = 0, led = 0, total = 0;
+    ws2811_return_t ret;
+    uint64_t start;
+    int i;
 
-    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)         // Channel
+    if ((device->driver_mode == PWM) && ws2811->channel[1].count)
     {
-        ws2811_channel_t *channel = &ws2811->channel[chan];
-
-        int wordpos = chan; // PWM & PCM
-        int bytepos = 0;    // SPI
-        const int scale = (channel->brightness & 0xff) + 1;
-        uint8_t array_size = 3; // Assume 3 color LEDs, RGB
+        return WS2811_ERROR_NOT_SUPPORTED;
+    }
 
-        // If our shift mask includes the highest nibble, then we have 4 LEDs, RBGW.
-        if (channel->strip_type & SK6812_SHIFT_WMASK)
+    for (i = 0; i < run_count; i++)
+    {
+        if (runs[i].count < 0)
         {
-            array_size = 4;
+            return WS2811_ERROR_GENERIC;
         }
+        total += runs[i].count;
+    }
+    if (total != channel->count)
+    {
+        return WS2811_ERROR_GENERIC;
+    }
 
-        // 1.25µs per bit
-        const uint32_t channel_protocol_time = channel->count * array_size * 8 * 1.25;
+    start = get_microsecond_timestamp();
+    lut = channel_lut(ws2811, 0);
+    frame.linear = !device->backend->dma || !device->dma_run_cb_count;
 
-        // Only using the channel which takes the longest as both run in parallel
-        if (channel_protocol_time > protocol_time)
+    while (led < channel->count)
+    {
+        const int count = channel->count - led < RUN_GROUP_LEDS ? channel->count - led : RUN_GROUP_LEDS;
+        const int offset = (led / RUN_GROUP_LEDS) * group_bytes;
+        int reps = 1, bytes;
+
+        while (!left)
         {
-            protocol_time = channel_protocol_time;
+            left = runs[run++].count;
         }
 
-        for (i = 0; i < channel->count; i++)                // Led
+        // Groups inside one run are repeated, any other group is sent once
+        if ((count == RUN_GROUP_LEDS) && (left >= 2 * RUN_GROUP_LEDS))
         {
-            uint8_t color[] =
+            reps = left / RUN_GROUP_LEDS;
+            for (i = 0; i < RUN_GROUP_LEDS; i++)
             {
-                channel->gamma[(((channel->leds[i] >> channel->rshift) & 0xff) * scale) >> 8], // red
-                channel->gamma[(((channel->leds[i] >> channel->gshift) & 0xff) * scale) >> 8], // green
-                channel->gamma[(((channel->leds[i] >> channel->bshift) & 0xff) * scale) >> 8], // blue
-                channel->gamma[(((channel->leds[i] >> channel->wshift) & 0xff) * scale) >> 8], // white
-            };
-
-            for (j = 0; j < array_size; j++)               // Color
+                group[i] = runs[run - 1].color;
+            }
+            left -= reps * RUN_GROUP_LEDS;
+        }
+        else
+        {
+            for (i = 0; i < count; i++)
             {
-				for(l = 0; l < 3; ++l)
-				{
-					uint8_t pos = driver_mode == SPI ? bytepos : 3 - bytepos;
-					uint8_t val = convert_table[l][color[j]];
-					if ((driver_mode != PWM) && channel->invert) val = ~val;
-					
-					pxl_raw[wordpos * 4 + pos] = val;
-					if(++bytepos == 4) 
-					{ 
-						bytepos = 0; 
-						wordpos += driver_mode == PWM ? 2 : 1; 
-					}
-				}
+                while (!left)
+                {
+                    left = runs[run++].count;
+                }
+                group[i] = runs[run - 1].color;
+                left--;
             }
         }
+
+        // The last group runs up to the end of the buffer, which is word aligned
+        bytes = offset + group_bytes > device->pxl_size ? device->pxl_size - offset : group_bytes;
+
+        memset(scratch, 0, sizeof(scratch));
+        encode_leds(ws2811, 0, group, lut, (uint8_t *)scratch, 0, count);
+        copy_to_dma(device->pxl_raw + offset, (const uint8_t *)scratch, 0, bytes / sizeof(uint32_t));
+
+        run_add(device, &frame, (const uint8_t *)scratch, offset, bytes, reps > 1 ? reps : 0);
+        led += reps * RUN_GROUP_LEDS;
+    }
+
+    // The staging buffer no longer matches what was sent, so the next render encodes everything
+    device->shadow[0].valid = 0;
+
+    // Only for this transfer, dma_start() selects the next buffer with its regular chain
+    if (!frame.linear && frame.count)
+    {
+        device->dma_cb_addr = run_chain(device, &frame);
+    }
+
+    ws2811->stats.frames++;
+    ws2811->stats.encode_us += get_microsecond_timestamp() - start;
+
+    ret = start_transfer(ws2811, frame_protocol_time(ws2811));
+    if ((ret != WS2811_SUCCESS) && device->backend->dma)
+    {
+        select_dma_buffer(device, device->buf_index);
+    }
+
+    return ret;
+}
+
+/**
+ * Encode a sequence of frames once into DMA memory of their own and link their
+ * control blocks into a cycle, so the DMA engine plays them over and over without
+ * any CPU use.  Every frame is followed by frame_gap_us of idle line, at least the
+ * reset time, which sets the frame rate.  Starting a loop while another one runs
+ * swaps them once the current frame is done.  The loop runs until
+ * ws2811_loop_stop(), ws2811_render() or ws2811_fini().  Not available for SPI
+ * or capture.
+ *
+ * @param    ws2811        ws2811 instance pointer.
+ * @param    frames        LED values per frame and channel.  A NULL entry takes the
+ *                         values from channel[].leds.
+ * @param    frame_count   Number of frames.
+ * @param    frame_gap_us  Idle time after every frame in microseconds.
+ *
+ * @returns  0 on success, value from ws2811_return_t enum otherwise.
+ */
+ws2811_return_t ws2811_loop_start(ws2811_t *ws2811, const ws2811_led_t *const frames[][RPI_PWM_CHANNELS],
+                                  int frame_count, uint32_t frame_gap_us)
+{
+    ws2811_device_t *device = ws2811->device;
+    encode_result_t result;
+    frame_loop_t *loop;
+    volatile dma_cb_t *dma_cb;
+    volatile uint8_t *pxl;
+    uint8_t *buf;
+    uint64_t gap_bytes;
+    uint32_t zero_ad;
+    int frame, gap_cbs;
+    ws2811_return_t ret;
+
+    if (!device->backend->dma)
+    {
+        return WS2811_ERROR_NOT_SUPPORTED;
+    }
+
+    if (frame_count < 1)
+    {
+        return WS2811_ERROR_GENERIC;
+    }
+
+    // 3 symbols per bit of idle time, at least the reset time
+    gap_bytes = (((((uint64_t)frame_gap_us * ws2811->freq * 3) / 1000000) + 31) / 32) * 4;
+    if (gap_bytes < RESET_BYTE_COUNT(ws2811->freq))
+    {
+        gap_bytes = RESET_BYTE_COUNT(ws2811->freq);
+    }
+    if (device->driver_mode == PWM)
+    {
+        gap_bytes *= RPI_PWM_CHANNELS;
+    }
+    if (gap_bytes > DMA_MAX_TXFR)
+    {
+        return WS2811_ERROR_GENERIC;
+    }
+    gap_cbs = (gap_bytes + device->dma_max_txfr - 1) / device->dma_max_txfr;
+
+    loop = calloc(1, sizeof(*loop));
+    if (!loop)
+    {
+        return WS2811_ERROR_OUT_OF_MEMORY;
     }
+    loop->frames = frame_count;
+    loop->frame_cbs = device->dma_cb_count + gap_cbs;
+    loop->frame_us = wire_time_us(ws2811, device->pxl_size + gap_bytes);
 
-    // Wait for any previous DMA operation to complete.
-    if ((ret = ws2811_wait(ws2811)) != WS2811_SUCCESS)
+    // Control blocks of all frames first, followed by the frames
+    loop->mbox.size = ((sizeof(dma_cb_t) * loop->frame_cbs) + device->pxl_size) * frame_count;
+    ret = dma_mem_alloc(ws2811, &loop->mbox);
+    if (ret != WS2811_SUCCESS)
     {
+        free(loop);
         return ret;
     }
+    dma_cb = (volatile dma_cb_t *)loop->mbox.virt_addr;
+    pxl = loop->mbox.virt_addr + (sizeof(dma_cb_t) * loop->frame_cbs * frame_count);
 
-    if (ws2811->render_wait_time != 0) {
-        const uint64_t current_timestamp = get_microsecond_timestamp();
-        uint64_t time_diff = current_timestamp - previous_timestamp;
+    // Frames are encoded into cached memory and copied, padding stays zero
+    buf = calloc(1, device->pxl_size);
+    if (!buf)
+    {
+        dma_mem_free(&loop->mbox);
+        free(loop);
+        return WS2811_ERROR_OUT_OF_MEMORY;
+    }
 
-        if (ws2811->render_wait_time > time_diff) {
-            usleep(ws2811->render_wait_time - time_diff);
-        }
+    // The gaps are sent from the zero word of the regular buffers
+    zero_ad = addr_to_bus(device, device->dma_zero);
+
+    for (frame = 0; frame < frame_count; frame++)
+    {
+        volatile dma_cb_t *frame_cb = &dma_cb[frame * loop->frame_cbs];
+        volatile uint8_t *frame_pxl = pxl + (device->pxl_size * frame);
+        uint32_t frame_cb_ad = loop->mbox.bus_addr + ((uint8_t *)frame_cb - loop->mbox.virt_addr);
+        uint32_t gap_cb_ad = frame_cb_ad + (sizeof(dma_cb_t) * device->dma_cb_count);
+        uint32_t next_cb_ad = loop->mbox.bus_addr +
+                              (sizeof(dma_cb_t) * loop->frame_cbs * ((frame + 1) % frame_count));
+
+        encode_frame(ws2811, frames[frame], buf, &result);
+        copy_to_dma(frame_pxl, buf, 0, device->pxl_size / sizeof(uint32_t));
+
+        build_dma_chain(device, frame_cb, frame_cb_ad,
+                        loop->mbox.bus_addr + ((uint8_t *)frame_pxl - loop->mbox.virt_addr), 1,
+                        device->pxl_size, gap_cb_ad);
+        build_dma_chain(device, &frame_cb[device->dma_cb_count], gap_cb_ad, zero_ad, 0, gap_bytes, next_cb_ad);
+    }
+    free(buf);
+
+    // Let the frame or loop being sent finish, then start on the first frame
+    if (((ret = ws2811_loop_stop(ws2811)) != WS2811_SUCCESS) ||
+        ((ret = ws2811_wait(ws2811)) != WS2811_SUCCESS))
+    {
+        dma_mem_free(&loop->mbox);
+        free(loop);
+        return ret;
     }
 
-    if (driver_mode != SPI)
+    dma_run(ws2811, loop->mbox.bus_addr);
+    device->loop = loop;
+    device->sent_valid = 0;
+
+    return WS2811_SUCCESS;
+}
+
+/**
+ * Stop a loop started by ws2811_loop_start() once the frame being sent is done,
+ * and release its memory.  Does nothing if no loop is running.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  0 on success, value from ws2811_return_t enum otherwise.
+ */
+ws2811_return_t ws2811_loop_stop(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+    frame_loop_t *loop = device->loop;
+    volatile dma_cb_t *dma_cb;
+    ws2811_return_t ret;
+    int frame;
+
+    if (!loop)
     {
-        dma_start(ws2811);
+        return WS2811_SUCCESS;
     }
-    else
+
+    // Unlink the frames, the engine stops after the gap of the frame being sent.  It may
+    // have loaded the link to the next frame already, so allow for that one too.
+    dma_cb = (volatile dma_cb_t *)loop->mbox.virt_addr;
+    for (frame = 0; frame < loop->frames; frame++)
     {
-        ret = spi_transfer(ws2811);
+        dma_cb[((frame + 1) * loop->frame_cbs) - 1].nextconbk = 0;
     }
 
-    // LED_RESET_WAIT_TIME is added to allow enough time for the reset to occur.
-    previous_timestamp = get_microsecond_timestamp();
-    ws2811->render_wait_time = protocol_time + LED_RESET_WAIT_TIME;
+    device->loop = NULL;
+    device->dma_done_us = get_microsecond_timestamp() + (2 * loop->frame_us);
+    ret = ws2811_wait(ws2811);
+
+    dma_mem_free(&loop->mbox);
+    free(loop);
 
     return ret;
 }
@@ -42,6 +42,7 @@ extern "C" {
 
 
 #define WS2811_TARGET_FREQ                       800000   // Can go as low as 400000
+#define WS2811_RESET_US                          55       // Idle time that latches the LED data
 
 // 4 color R, G, B and W ordering
 #define SK6812_STRIP_RGBW                        0x18100800
@@ -65,6 +66,13 @@ extern "C" {
 #define SK6812_STRIP                             WS2811_STRIP_GRB
 #define SK6812W_STRIP                            SK6812_STRIP_GRBW
 
+// Wire formats, picked by the GPIO of channel 0
+#define WS2811_LAYOUT_PWM                        1   // 32 bit words, alternating between the channels
+#define WS2811_LAYOUT_PCM                        2   // 32 bit words
+#define WS2811_LAYOUT_SPI                        3   // Bytes
+
+#define WS2811_CAPTURE_MAGIC                     0x31435357   // "WSC1"
+
 struct ws2811_device;
 
 typedef uint32_t ws2811_led_t;                   //< 0xWWRRGGBB
@@ -83,6 +91,53 @@ typedef struct ws2811_channel_t
     uint8_t *gamma;                              //< Gamma correction table
 } ws2811_channel_t;
 
+typedef struct
+{
+    uint64_t frames;                             //< Number of frames rendered
+    uint64_t encode_us;                          //< Total time spent encoding LED data
+    uint64_t copy_us;                            //< Total time spent copying the staging buffer to DMA memory
+    uint64_t leds_skipped;                       //< LEDs not encoded because they didn't change
+    uint64_t cache_hits;                         //< Frames sent from the encoded frame cache
+    uint64_t cache_misses;                       //< Frames ws2811_render_cached() didn't find
+    uint64_t frames_skipped;                     //< Frames ws2811_render() didn't send because they were unchanged
+    uint64_t kick_us;                            //< Total time spent starting the DMA, channel resets included
+    uint64_t dma_resets;                         //< DMA starts that needed the full channel reset
+} ws2811_stats_t;
+
+typedef struct
+{
+    ws2811_led_t color;                          //< LED value
+    int count;                                   //< Number of consecutive LEDs with that value
+} ws2811_run_t;
+
+// Written before the wire stream of every frame in a capture file
+typedef struct
+{
+    uint32_t magic;                              //< WS2811_CAPTURE_MAGIC
+    uint32_t layout;                             //< WS2811_LAYOUT_xxx
+    uint32_t freq;                               //< Output frequency, 3 symbols per bit
+    uint32_t data_bytes;                         //< LED data at the start of the wire stream
+    uint32_t bytes;                              //< Size of the wire stream, LED data plus reset time
+    uint32_t reserved;
+    uint64_t start_us;                           //< When the frame started, simulated unless captured in real time
+} ws2811_capture_header_t;
+
+typedef struct
+{
+    int enabled;                                 //< Capture frames instead of sending them, no Raspberry Pi needed
+    int realtime;                                //< Take as long as sending would, instead of simulating the time
+    const char *file;                            //< Append every frame to this file, NULL to keep only the last one
+    const uint8_t *frame;                        //< Wire stream of the last frame, set by the driver
+    uint32_t frame_bytes;                        //< Size of frame in bytes, LED data plus reset time
+    uint64_t frame_start_us;                     //< When the last frame started
+    uint64_t frames;                             //< Number of frames captured
+} ws2811_capture_t;
+
+struct ws2811_t;
+
+// Called from the queue thread with the presentation time the frame was submitted with
+typedef void (*ws2811_frame_cb_t)(struct ws2811_t *ws2811, uint64_t present_at_us, void *arg);
+
 typedef struct ws2811_t
 {
     uint64_t render_wait_time;                   //< time in µs before the next render can run
@@ -91,6 +146,17 @@ typedef struct ws2811_t
     uint32_t freq;                               //< Required output frequency
     int dmanum;                                  //< DMA number _not_ already in use
     ws2811_channel_t channel[RPI_PWM_CHANNELS];
+    int render_direct;                           //< Encode straight into uncached DMA memory, bypassing the staging buffer
+    int encode_threads;                          //< Threads encoding long strips, including the caller. 0 or 1 for none
+    ws2811_stats_t stats;                        //< Render statistics, updated by the driver
+    int queue_depth;                             //< Frames ws2811_submit() can queue, 0 to disable the queue
+    ws2811_frame_cb_t frame_done;                //< Called when a submitted frame has been sent, may be NULL
+    ws2811_frame_cb_t frame_dropped;             //< Called when a submitted frame was skipped for being late, may be NULL
+    void *callback_arg;                          //< Passed to frame_done and frame_dropped
+    int frame_cache_size;                        //< Encoded frames ws2811_render_store() keeps, 0 to disable.  Changing it drops them
+    int skip_unchanged;                          //< ws2811_render() doesn't send a frame identical to the last one
+    uint32_t keepalive_us;                       //< Send an unchanged frame again after this many µs, 0 for never
+    ws2811_capture_t capture;                    //< Capture backend settings and the last captured frame
 } ws2811_t;
 
 #define WS2811_RETURN_STATES(X)                                                             \
@@ -108,7 +174,11 @@ typedef struct ws2811_t
             X(-11, WS2811_ERROR_ILLEGAL_GPIO, "Selected GPIO not possible"),                \
             X(-12, WS2811_ERROR_PCM_SETUP, "Unable to initialize PCM"),                     \
             X(-13, WS2811_ERROR_SPI_SETUP, "Unable to initialize SPI"),                     \
-            X(-14, WS2811_ERROR_SPI_TRANSFER, "SPI transfer error")                         \
+            X(-14, WS2811_ERROR_SPI_TRANSFER, "SPI transfer error"),                        \
+            X(-15, WS2811_ERROR_NO_QUEUE, "Frame queue is not enabled"),                    \
+            X(-16, WS2811_ERROR_NOT_SUPPORTED, "Not supported in this driver mode"),        \
+            X(-17, WS2811_ERROR_NOT_CACHED, "Frame is not in the cache"),                   \
+            X(-18, WS2811_ERROR_CAPTURE, "Unable to write the capture file")                \
 
 #define WS2811_RETURN_STATES_ENUM(state, name, str) name = state
 #define WS2811_RETURN_STATES_STRING(state, name, str) str
@@ -123,6 +193,16 @@ ws2811_return_t ws2811_init(ws2811_t *ws2811);
 void ws2811_fini(ws2811_t *ws2811);                                             //< Tear it all down
 ws2811_return_t ws2811_render(ws2811_t *ws2811);                                //< Send LEDs off to hardware
 ws2811_return_t ws2811_wait(ws2811_t *ws2811);                                  //< Wait for DMA completion
+ws2811_return_t ws2811_submit(ws2811_t *ws2811, const ws2811_led_t *const leds[RPI_PWM_CHANNELS],
+                              uint64_t present_at_us);                          //< Queue a frame to be sent at a CLOCK_MONOTONIC time
+ws2811_return_t ws2811_render_cached(ws2811_t *ws2811, uint64_t frame_id);      //< Send a frame kept by ws2811_render_store()
+ws2811_return_t ws2811_render_store(ws2811_t *ws2811, uint64_t frame_id);       //< Render and keep the encoded frame
+ws2811_return_t ws2811_render_runs(ws2811_t *ws2811, const ws2811_run_t *runs,
+                                   int run_count);                              //< Send channel 0 described as runs of one colour
+ws2811_return_t ws2811_loop_start(ws2811_t *ws2811, const ws2811_led_t *const frames[][RPI_PWM_CHANNELS],
+                                  int frame_count, uint32_t frame_gap_us);      //< Play frames over and over from DMA memory
+ws2811_return_t ws2811_loop_stop(ws2811_t *ws2811);                             //< Stop a frame loop after the current frame
+int ws2811_get_completion_fd(ws2811_t *ws2811);                                 //< Pollable fd, readable when the next frame can be sent
 const char * ws2811_get_return_t_str(const ws2811_return_t state);              //< Get string representation of the given return state
 void ws2811_set_custom_gamma_factor(ws2811_t *ws2811, double gamma_factor);     //< Set a custom Gamma correction array based on a gamma correction factor
 
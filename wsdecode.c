@@ -0,0 +1,1149 @@
+/*
+ * wsdecode.c
+ *
+ * Copyright (c) 2014 Jeremy Garff <jer @ jers.net>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "ws2811.h"
+#include "encode.h"
+#include "decode.h"
+
+
+#define SELFTEST_MAX_LEDS                        1024
+#define SELFTEST_ROUNDS                          64
+#define SELFTEST_CUSTOM_STRIP                    0x10180800   // White between red and green, not predefined
+#define PACING_TOLERANCE_US                      150
+#define PACING_DRIFT_US                          50
+#define PACING_MAX_FRAMES                        96
+#define RENDER_FRAMES                            4
+
+static struct
+{
+    const char *name;
+    uint32_t strip_type;
+} strip_names[] =
+{
+    { "rgb", WS2811_STRIP_RGB },
+    { "rbg", WS2811_STRIP_RBG },
+    { "grb", WS2811_STRIP_GRB },
+    { "gbr", WS2811_STRIP_GBR },
+    { "brg", WS2811_STRIP_BRG },
+    { "bgr", WS2811_STRIP_BGR },
+    { "rgbw", SK6812_STRIP_RGBW },
+    { "rbgw", SK6812_STRIP_RBGW },
+    { "grbw", SK6812_STRIP_GRBW },
+    { "gbrw", SK6812_STRIP_GBRW },
+    { "brgw", SK6812_STRIP_BRGW },
+    { "bgrw", SK6812_STRIP_BGRW },
+};
+
+static const char *layout_names[] = { "none", "pwm", "pcm", "spi" };
+
+static int layout = WS2811_LAYOUT_PWM;
+static uint32_t freq = WS2811_TARGET_FREQ;
+static uint32_t strip_type = WS2812_STRIP;
+static int invert;
+static int verbose;
+static int selftest;
+static int pacing;
+
+static double elapsed_us(struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return ((now.tv_sec - start->tv_sec) * 1000000.0) + ((now.tv_nsec - start->tv_nsec) / 1000.0);
+}
+
+/**
+ * Decode and report every channel of one wire stream.
+ *
+ * @param    frame   Frame number.
+ * @param    stream  Wire stream.
+ * @param    bytes   Size of the wire stream.
+ * @param    layout  WS2811_LAYOUT_xxx.
+ * @param    freq    Output frequency.
+ *
+ * @returns  0 if every channel decoded cleanly with a long enough reset time, -1 otherwise.
+ */
+static int report_frame(uint64_t frame, const uint8_t *stream, uint32_t bytes, int layout,
+                        uint32_t freq)
+{
+    const int channels = (layout == WS2811_LAYOUT_PWM) ? 2 : 1;
+    const int colours = (strip_type & SK6812_SHIFT_WMASK) ? 4 : 3;
+    ws2811_led_t *leds = malloc(bytes / ENCODE_BYTES_PER_COLOUR * sizeof(*leds) + 1);
+    int ret = 0;
+    int chan;
+
+    if (!leds)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+
+    for (chan = 0; chan < channels; chan++)
+    {
+        decode_result_t result;
+        int i;
+
+        decode_channel(stream, bytes, layout, chan, invert, freq, strip_type, leds,
+                       bytes / ENCODE_BYTES_PER_COLOUR, &result);
+
+        printf("frame %llu channel %d: %d leds", (unsigned long long)frame, chan, result.leds);
+        if (result.colours % colours)
+        {
+            printf(" + %d colour bytes", result.colours % colours);
+        }
+        if (result.bad_symbols)
+        {
+            printf(", %d bad colour bytes from %d", result.bad_symbols, result.first_bad);
+        }
+        printf(", reset %u us %s\n", result.reset_us, result.reset_ok ? "ok" : "SHORT");
+
+        if (verbose)
+        {
+            for (i = 0; i < result.leds; i++)
+            {
+                printf("%s%08x", (i % 8) ? " " : "  ", leds[i]);
+                if (((i % 8) == 7) || (i == result.leds - 1))
+                {
+                    printf("\n");
+                }
+            }
+        }
+
+        if (result.bad_symbols || !result.reset_ok)
+        {
+            ret = -1;
+        }
+    }
+
+    free(leds);
+
+    return ret;
+}
+
+/**
+ * Decode a capture file, or a raw dump of pxl_raw in the layout given on the
+ * command line.
+ *
+ * @param    file  File name.
+ *
+ * @returns  0 if every frame decoded cleanly, -1 otherwise.
+ */
+static int decode_file(const char *file)
+{
+    FILE *f = fopen(file, "rb");
+    ws2811_capture_header_t header;
+    uint64_t frame = 0;
+    uint8_t *stream = NULL;
+    int ret = 0;
+
+    if (!f)
+    {
+        perror(file);
+        return -1;
+    }
+
+    if ((fread(&header, sizeof(header), 1, f) == 1) && (header.magic == WS2811_CAPTURE_MAGIC))
+    {
+        do
+        {
+            if ((header.magic != WS2811_CAPTURE_MAGIC) ||
+                (header.layout < WS2811_LAYOUT_PWM) || (header.layout > WS2811_LAYOUT_SPI))
+            {
+                fprintf(stderr, "%s: bad header at frame %llu\n", file, (unsigned long long)frame);
+                ret = -1;
+                break;
+            }
+
+            free(stream);
+            stream = malloc(header.bytes + 1);
+            if (!stream || (fread(stream, 1, header.bytes, f) != header.bytes))
+            {
+                fprintf(stderr, "%s: frame %llu truncated\n", file, (unsigned long long)frame);
+                ret = -1;
+                break;
+            }
+
+            if (verbose)
+            {
+                printf("frame %llu: %s, %u Hz, %u of %u bytes LED data, start %llu us\n",
+                       (unsigned long long)frame, layout_names[header.layout], header.freq,
+                       header.data_bytes, header.bytes, (unsigned long long)header.start_us);
+            }
+
+            if (report_frame(frame++, stream, header.bytes, header.layout, header.freq))
+            {
+                ret = -1;
+            }
+        } while (fread(&header, sizeof(header), 1, f) == 1);
+    }
+    else
+    {
+        long size;
+
+        fseek(f, 0, SEEK_END);
+        size = ftell(f);
+        rewind(f);
+
+        stream = malloc(size + 1);
+        if (!stream || (fread(stream, 1, size, f) != (size_t)size))
+        {
+            fprintf(stderr, "%s: read failed\n", file);
+            ret = -1;
+        }
+        else
+        {
+            ret = report_frame(0, stream, size, layout, freq);
+        }
+    }
+
+    free(stream);
+    fclose(f);
+
+    return ret;
+}
+
+/**
+ * Run every symbol expander and LED kernel on random data.  The expanders must
+ * match the reference table output byte for byte, and the decoder must get back
+ * what went into the kernels.  render_test() checks the decoder against the
+ * streams the driver sends.
+ *
+ * @returns  0 if everything matched, -1 otherwise.
+ */
+static int self_test(void)
+{
+    const int max_bytes = SELFTEST_MAX_LEDS * 4;
+    const int reset_bytes = (((WS2811_RESET_US * (freq * 3)) / 1000000 + 31) / 32) * 4 + 4;
+    const int pxl_bytes = 2 * (max_bytes * ENCODE_BYTES_PER_COLOUR + 4 + reset_bytes);
+    uint8_t *colours = malloc(max_bytes);
+    uint8_t *reference = malloc(max_bytes * ENCODE_BYTES_PER_COLOUR);
+    uint8_t *wire = malloc(max_bytes * ENCODE_BYTES_PER_COLOUR);
+    uint8_t *pxl = malloc(pxl_bytes);
+    ws2811_led_t *leds = malloc(SELFTEST_MAX_LEDS * sizeof(*leds));
+    ws2811_led_t *out = malloc(SELFTEST_MAX_LEDS * sizeof(*out));
+    // Layout and invert setting of each custom kernel
+    static const int custom_kernels[][2] = {
+        { ENCODE_LAYOUT_PWM, 0 },
+        { ENCODE_LAYOUT_PCM, 0 },
+        { ENCODE_LAYOUT_PCM, 1 },
+        { ENCODE_LAYOUT_SPI, 0 },
+        { ENCODE_LAYOUT_SPI, 1 },
+    };
+    const int custom_count = sizeof(custom_kernels) / sizeof(custom_kernels[0]);
+    const encode_kernel_t *kernels;
+    uint8_t lut[256];
+    int kernel_count;
+    int failures = 0;
+    int impl, i, k, round;
+
+    if (!colours || !reference || !wire || !pxl || !leds || !out)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+
+    srand(time(NULL));
+
+    // Not the identity, so a kernel skipping the table shows up
+    for (i = 0; i < 256; i++)
+    {
+        lut[i] = 255 - i;
+    }
+
+    for (impl = 0; impl < ENCODE_IMPL_COUNT; impl++)
+    {
+        encode_fn_t fn = encode_get_impl(impl);
+        int bad = 0;
+
+        if (!fn)
+        {
+            printf("%-8s not supported\n", encode_impl_name(impl));
+            continue;
+        }
+
+        for (round = 0; round < SELFTEST_ROUNDS; round++)
+        {
+            const int count = 1 + (rand() % max_bytes);
+
+            for (i = 0; i < count; i++)
+            {
+                colours[i] = rand();
+            }
+
+            encode_get_impl(ENCODE_IMPL_TABLE)(reference, colours, count);
+            fn(wire, colours, count);
+
+            if (memcmp(wire, reference, count * ENCODE_BYTES_PER_COLOUR))
+            {
+                bad++;
+            }
+        }
+
+        printf("%-8s %s\n", encode_impl_name(impl), bad ? "FAILED" : "ok");
+        failures += bad;
+    }
+
+    kernels = encode_kernels(&kernel_count);
+
+    // The specialized kernels, then the custom ones on a strip type without a kernel
+    for (k = 0; k < kernel_count + custom_count; k++)
+    {
+        const encode_kernel_t *kernel = (k < kernel_count) ? &kernels[k] :
+                                        encode_get_kernel(custom_kernels[k - kernel_count][0],
+                                                          SELFTEST_CUSTOM_STRIP,
+                                                          custom_kernels[k - kernel_count][1]);
+        const uint32_t strip = kernel->strip_type ? kernel->strip_type : SELFTEST_CUSTOM_STRIP;
+        const int wire_layout = kernel->layout + WS2811_LAYOUT_PWM;
+        int bad = 0;
+
+        for (round = 0; round < SELFTEST_ROUNDS; round++)
+        {
+            const int count = rand() % (SELFTEST_MAX_LEDS + 1);
+            const int colour_count = (strip & SK6812_SHIFT_WMASK) ? 4 : 3;
+            const int shifts[4] = {
+                (strip >> 16) & 0xff,
+                (strip >> 8) & 0xff,
+                strip & 0xff,
+                (strip >> 24) & 0xff,
+            };
+            const uint32_t chan_bytes = ((count * colour_count * ENCODE_BYTES_PER_COLOUR + 3) / 4) * 4;
+            const uint32_t bytes = (chan_bytes + reset_bytes) *
+                                   ((kernel->layout == ENCODE_LAYOUT_PWM) ? 2 : 1);
+            decode_result_t result;
+
+            for (i = 0; i < count; i++)
+            {
+                leds[i] = rand() ^ ((uint32_t)rand() << 16);
+            }
+
+            memset(pxl, 0, pxl_bytes);
+            kernel->fn(pxl, leds, lut, 0, count, strip);
+
+            decode_channel(pxl, bytes, wire_layout, 0, kernel->invert, freq, strip,
+                           out, SELFTEST_MAX_LEDS, &result);
+
+            if ((result.leds != count) || (result.colours != count * colour_count) ||
+                result.bad_symbols || !result.reset_ok)
+            {
+                bad++;
+                continue;
+            }
+
+            for (i = 0; i < count; i++)
+            {
+                ws2811_led_t expected = 0;
+                int c;
+
+                for (c = 0; c < colour_count; c++)
+                {
+                    expected |= (ws2811_led_t)lut[(leds[i] >> shifts[c]) & 0xff] << shifts[c];
+                }
+
+                if (out[i] != expected)
+                {
+                    bad++;
+                    break;
+                }
+            }
+        }
+
+        if (bad || verbose)
+        {
+            printf("%-16s %s\n", kernel->name, bad ? "FAILED" : "ok");
+        }
+        failures += bad;
+    }
+
+    printf("%d kernels, %s\n", kernel_count + custom_count, failures ? "FAILED" : "all ok");
+
+    free(colours);
+    free(reference);
+    free(wire);
+    free(pxl);
+    free(leds);
+    free(out);
+
+    return failures ? -1 : 0;
+}
+
+// A way of sending frames that render_test() checks through the capture backend
+typedef struct
+{
+    const char *name;
+    int gpionum;                                 // Picks the layout
+    int count[RPI_PWM_CHANNELS];
+    int invert;
+    int render_direct;
+    int encode_threads;
+    int cache;                                   // Through ws2811_render_store() and ws2811_render_cached()
+    int queue;                                   // Through ws2811_submit()
+    int runs;                                    // Every other frame through ws2811_render_runs()
+} render_case_t;
+
+static const render_case_t render_cases[] =
+{
+    { .name = "pwm staged",      .gpionum = 18, .count = { 300, 0 } },
+    { .name = "pwm direct",      .gpionum = 18, .count = { 300, 0 }, .render_direct = 1 },
+    { .name = "pwm pair",        .gpionum = 18, .count = { 300, 177 } },
+    { .name = "pwm threads",     .gpionum = 18, .count = { 1500, 1203 }, .encode_threads = 4 },
+    { .name = "pwm cache",       .gpionum = 18, .count = { 300, 177 }, .cache = 2 },
+    { .name = "pwm queue",       .gpionum = 18, .count = { 300, 177 }, .queue = 2 },
+    { .name = "pwm runs",        .gpionum = 18, .count = { 300, 0 }, .runs = 1 },
+    { .name = "pcm staged",      .gpionum = 21, .count = { 300, 0 } },
+    { .name = "pcm direct",      .gpionum = 21, .count = { 300, 0 }, .render_direct = 1 },
+    { .name = "pcm inverted",    .gpionum = 21, .count = { 300, 0 }, .invert = 1 },
+    { .name = "pcm threads",     .gpionum = 21, .count = { 2001, 0 }, .encode_threads = 4 },
+    { .name = "pcm cache",       .gpionum = 21, .count = { 300, 0 }, .cache = 2 },
+    { .name = "pcm queue",       .gpionum = 21, .count = { 300, 0 }, .queue = 2 },
+    { .name = "pcm runs",        .gpionum = 21, .count = { 300, 0 }, .runs = 1 },
+    { .name = "spi",             .gpionum = 10, .count = { 300, 0 } },
+    { .name = "spi inverted",    .gpionum = 10, .count = { 300, 0 }, .invert = 1 },
+    { .name = "spi threads",     .gpionum = 10, .count = { 2001, 0 }, .encode_threads = 4 },
+    { .name = "spi cache",       .gpionum = 10, .count = { 300, 0 }, .cache = 2 },
+    { .name = "spi queue",       .gpionum = 10, .count = { 300, 0 }, .queue = 2 },
+    { .name = "spi runs",        .gpionum = 10, .count = { 300, 0 }, .runs = 1 },
+};
+
+// Frames the queue thread has sent, waited for by render_test()
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int sent;
+} render_queue_t;
+
+static void render_frame_sent(ws2811_t *ws2811, uint64_t present_at_us, void *arg)
+{
+    render_queue_t *queue = arg;
+
+    (void)ws2811;
+    (void)present_at_us;
+
+    pthread_mutex_lock(&queue->lock);
+    queue->sent++;
+    pthread_cond_signal(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * Decode the last captured frame and compare it with the LED values that went in.
+ * Brightness is 255 and the gamma table the identity, so they come out unchanged.
+ *
+ * @param    ws2811    ws2811 instance pointer.
+ * @param    layout    WS2811_LAYOUT_xxx of the capture.
+ * @param    expected  LED values per channel.
+ * @param    out       Room for the decoded LEDs of the longest channel, plus one.
+ *
+ * @returns  0 if every channel matched with a long enough reset time, -1 otherwise.
+ */
+static int render_check(ws2811_t *ws2811, int layout, ws2811_led_t *const expected[RPI_PWM_CHANNELS],
+                        ws2811_led_t *out)
+{
+    int chan;
+
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        ws2811_channel_t *channel = &ws2811->channel[chan];
+        decode_result_t result;
+
+        if (!channel->count)
+        {
+            continue;
+        }
+
+        // PWM inverts in hardware, so only PCM and SPI streams are inverted
+        decode_channel(ws2811->capture.frame, ws2811->capture.frame_bytes, layout, chan,
+                       (layout != WS2811_LAYOUT_PWM) && channel->invert, ws2811->freq,
+                       channel->strip_type, out, channel->count + 1, &result);
+
+        if ((result.leds != channel->count) || result.bad_symbols || !result.reset_ok ||
+            memcmp(out, expected[chan], channel->count * sizeof(*out)))
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Fill LEDs with runs of random length and value.  Most are long enough to be sent
+ * by repeating a group of LEDs, the rest are a few LEDs long.
+ *
+ * @param    runs   Set to the runs, room for one per LED.
+ * @param    leds   Set to the LED values the runs describe.
+ * @param    count  Number of LEDs.
+ * @param    mask   Colours the strip has.
+ *
+ * @returns  Number of runs.
+ */
+static int render_make_runs(ws2811_run_t *runs, ws2811_led_t *leds, int count, ws2811_led_t mask)
+{
+    int run_count = 0;
+    int led = 0;
+    int i;
+
+    while (led < count)
+    {
+        ws2811_run_t *run = &runs[run_count++];
+
+        run->color = (rand() ^ ((uint32_t)rand() << 16)) & mask;
+        run->count = (rand() % 3) ? 1 + (rand() % 80) : 1 + (rand() % 3);
+        if (run->count > count - led)
+        {
+            run->count = count - led;
+        }
+
+        for (i = 0; i < run->count; i++)
+        {
+            leds[led++] = run->color;
+        }
+    }
+
+    return run_count;
+}
+
+/**
+ * Render frames through every path of the driver into the capture backend, and
+ * decode what it captured.  The first frame is random, the second changes a few
+ * LEDs so only those are encoded again, the third is the same and the last is
+ * random again.  Cached frames are sent again from the cache in the last two.
+ * Run frames alternate with regular ones, and are made of runs of random length.
+ *
+ * @returns  0 if every frame decoded to what was rendered, -1 otherwise.
+ */
+static int render_test(void)
+{
+    const int colours = (strip_type & SK6812_SHIFT_WMASK) ? 4 : 3;
+    const ws2811_led_t mask = (colours == 4) ? 0xffffffff : 0x00ffffff;
+    struct timespec start;
+    double us = 0;
+    int failures = 0;
+    unsigned int c;
+
+    for (c = 0; c < sizeof(render_cases) / sizeof(render_cases[0]); c++)
+    {
+        const render_case_t *test = &render_cases[c];
+        const int layout = (test->gpionum == 18) ? WS2811_LAYOUT_PWM :
+                           (test->gpionum == 21) ? WS2811_LAYOUT_PCM : WS2811_LAYOUT_SPI;
+        render_queue_t queue = { .sent = 0 };
+        ws2811_t ws2811;
+        ws2811_led_t *frames[RENDER_FRAMES][RPI_PWM_CHANNELS] = { { NULL } };
+        ws2811_led_t *out;
+        ws2811_run_t *runs;
+        int run_count = 0;
+        int missing = 0;
+        ws2811_return_t ret;
+        uint64_t skipped = 0;
+        int frame, chan, i;
+        int bad = 0;
+
+        memset(&ws2811, 0, sizeof(ws2811));
+        ws2811.freq = freq;
+        ws2811.dmanum = 10;
+        ws2811.render_direct = test->render_direct;
+        ws2811.encode_threads = test->encode_threads;
+        ws2811.frame_cache_size = test->cache;
+        ws2811.queue_depth = test->queue;
+        ws2811.frame_done = render_frame_sent;
+        ws2811.callback_arg = &queue;
+        ws2811.capture.enabled = 1;
+        ws2811.channel[0].gpionum = test->gpionum;
+        if (layout == WS2811_LAYOUT_PWM)
+        {
+            ws2811.channel[1].gpionum = 13;
+        }
+        for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+        {
+            ws2811.channel[chan].count = test->count[chan];
+            ws2811.channel[chan].invert = test->invert;
+            ws2811.channel[chan].strip_type = strip_type;
+            ws2811.channel[chan].brightness = 255;
+        }
+
+        pthread_mutex_init(&queue.lock, NULL);
+        pthread_cond_init(&queue.cond, NULL);
+
+        if ((ret = ws2811_init(&ws2811)) != WS2811_SUCCESS)
+        {
+            fprintf(stderr, "%s: ws2811_init failed: %s\n", test->name, ws2811_get_return_t_str(ret));
+            failures++;
+            continue;
+        }
+
+        out = malloc((test->count[0] > test->count[1] ? test->count[0] : test->count[1]) * sizeof(*out) +
+                     sizeof(*out));
+        runs = malloc(test->count[0] * sizeof(*runs) + 1);
+        for (frame = 0; frame < RENDER_FRAMES; frame++)
+        {
+            for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+            {
+                frames[frame][chan] = malloc(test->count[chan] * sizeof(ws2811_led_t) + 1);
+                missing |= !frames[frame][chan];
+            }
+        }
+        if (!out || !runs || missing)
+        {
+            fprintf(stderr, "Out of memory\n");
+            ws2811_fini(&ws2811);
+            return -1;
+        }
+
+        for (frame = 0; (frame < RENDER_FRAMES) && !bad; frame++)
+        {
+            ws2811_led_t *const *expected = frames[frame];
+            int wrong;
+
+            for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+            {
+                ws2811_led_t *leds = frames[frame][chan];
+
+                // Run frames only use channel 0
+                if (test->runs && !(frame % 2) && !chan)
+                {
+                    run_count = render_make_runs(runs, leds, test->count[chan], mask);
+                }
+
+                for (i = 0; !(test->runs && !(frame % 2)) && (i < test->count[chan]); i++)
+                {
+                    if ((frame == 0) || (frame == RENDER_FRAMES - 1))
+                    {
+                        leds[i] = (rand() ^ ((uint32_t)rand() << 16)) & mask;
+                    }
+                    else
+                    {
+                        leds[i] = frames[frame - 1][chan][i];
+                        if ((frame == 1) && !(i % 37))
+                        {
+                            leds[i] = ~leds[i] & mask;
+                        }
+                    }
+                }
+                memcpy(ws2811.channel[chan].leds, leds, test->count[chan] * sizeof(*leds));
+            }
+
+            skipped = ws2811.stats.leds_skipped;
+
+            if (test->cache && (frame >= 2))
+            {
+                // Sends the first two frames again, channel[].leds aren't used
+                ret = ws2811_render_cached(&ws2811, frame - 2);
+                expected = frames[frame - 2];
+            }
+            else if (test->cache)
+            {
+                ret = ws2811_render_cached(&ws2811, frame);
+                if (ret == WS2811_ERROR_NOT_CACHED)
+                {
+                    ret = ws2811_render_store(&ws2811, frame);
+                }
+            }
+            else if (test->runs && !(frame % 2))
+            {
+                ret = ws2811_render_runs(&ws2811, runs, run_count);
+            }
+            else if (test->queue)
+            {
+                ret = ws2811_submit(&ws2811, NULL, 0);
+
+                pthread_mutex_lock(&queue.lock);
+                while ((ret == WS2811_SUCCESS) && (queue.sent <= frame))
+                {
+                    pthread_cond_wait(&queue.cond, &queue.lock);
+                }
+                pthread_mutex_unlock(&queue.lock);
+            }
+            else
+            {
+                ret = ws2811_render(&ws2811);
+            }
+
+            if (ret != WS2811_SUCCESS)
+            {
+                fprintf(stderr, "%s: frame %d: %s\n", test->name, frame, ws2811_get_return_t_str(ret));
+                bad++;
+                break;
+            }
+
+            // Only the LEDs that changed are encoded again, a run frame leaves nothing to compare with
+            if (!test->cache && !test->queue && !test->runs && (frame == 1) &&
+                (ws2811.stats.leds_skipped == skipped))
+            {
+                fprintf(stderr, "%s: every LED was encoded again\n", test->name);
+                bad++;
+            }
+
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            wrong = render_check(&ws2811, layout, expected, out);
+            us += elapsed_us(&start);
+            if (wrong)
+            {
+                fprintf(stderr, "%s: frame %d decoded wrong\n", test->name, frame);
+                bad++;
+            }
+        }
+
+        if (test->cache && (ws2811.stats.cache_hits != RENDER_FRAMES - 2))
+        {
+            fprintf(stderr, "%s: %llu cache hits\n", test->name, (unsigned long long)ws2811.stats.cache_hits);
+            bad++;
+        }
+
+        // A new cache size drops the stored frames
+        if (test->cache && !bad)
+        {
+            ws2811.frame_cache_size = test->cache + 1;
+            if ((ws2811_render_cached(&ws2811, 0) != WS2811_ERROR_NOT_CACHED) ||
+                (ws2811_render_store(&ws2811, 0) != WS2811_SUCCESS) ||
+                (ws2811_render_cached(&ws2811, 0) != WS2811_SUCCESS) ||
+                render_check(&ws2811, layout, frames[RENDER_FRAMES - 1], out))
+            {
+                fprintf(stderr, "%s: resizing the cache failed\n", test->name);
+                bad++;
+            }
+        }
+
+        ws2811_fini(&ws2811);
+        pthread_mutex_destroy(&queue.lock);
+        pthread_cond_destroy(&queue.cond);
+
+        free(out);
+        free(runs);
+        for (frame = 0; frame < RENDER_FRAMES; frame++)
+        {
+            for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+            {
+                free(frames[frame][chan]);
+            }
+        }
+
+        if (bad || verbose)
+        {
+            printf("%-16s %s\n", test->name, bad ? "FAILED" : "ok");
+        }
+        failures += bad;
+    }
+
+    printf("%d render paths, %s (decoded in %.0f us)\n", (int)(sizeof(render_cases) / sizeof(render_cases[0])),
+           failures ? "FAILED" : "all ok", us);
+
+    return failures ? -1 : 0;
+}
+
+// One of the instances pacing_test() runs, alone and side by side
+typedef struct
+{
+    const char *name;
+    ws2811_t ws2811;
+    int frames;
+    uint64_t gap_us[PACING_MAX_FRAMES];          // Time from each frame to the next
+    uint64_t spacing_us;                         // Median of gap_us, one late wakeup doesn't move it
+    ws2811_return_t ret;
+    int done;                                    // All frames sent
+    const int *partner_done;                     // Keep sending until the other instance is done too
+} pacing_instance_t;
+
+static int compare_us(const void *a, const void *b)
+{
+    const uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void *pacing_thread(void *arg)
+{
+    pacing_instance_t *instance = arg;
+    ws2811_t *ws2811 = &instance->ws2811;
+    uint64_t last_us = 0;
+    int frame, chan, i;
+
+    for (frame = 0; (frame < instance->frames) ||
+                    (instance->partner_done && !__atomic_load_n(instance->partner_done, __ATOMIC_ACQUIRE));
+         frame++)
+    {
+        for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+        {
+            for (i = 0; i < ws2811->channel[chan].count; i++)
+            {
+                ws2811->channel[chan].leds[i] = (frame * 0x010203) + i;
+            }
+        }
+
+        instance->ret = ws2811_render(ws2811);
+        if (instance->ret != WS2811_SUCCESS)
+        {
+            break;
+        }
+
+        if (frame && (frame < instance->frames))
+        {
+            instance->gap_us[frame - 1] = ws2811->capture.frame_start_us - last_us;
+        }
+        last_us = ws2811->capture.frame_start_us;
+
+        if (frame == instance->frames - 1)
+        {
+            __atomic_store_n(&instance->done, 1, __ATOMIC_RELEASE);
+        }
+    }
+    __atomic_store_n(&instance->done, 1, __ATOMIC_RELEASE);
+
+    qsort(instance->gap_us, instance->frames - 1, sizeof(instance->gap_us[0]), compare_us);
+    instance->spacing_us = instance->gap_us[(instance->frames - 1) / 2];
+
+    return NULL;
+}
+
+/**
+ * Run some of the instances, each from its own thread, until they sent all their
+ * frames.
+ *
+ * @param    instances  Instances to run.
+ * @param    count      Number of instances.
+ *
+ * @returns  0 if every frame was sent, -1 otherwise.
+ */
+static int pacing_run(pacing_instance_t *instances, int count)
+{
+    pthread_t threads[2];
+    int started[2] = { 0, 0 };
+    int failures = 0;
+    int i;
+
+    // Side by side, neither may finish early and leave the other to run alone
+    for (i = 0; i < count; i++)
+    {
+        instances[i].done = 0;
+        instances[i].partner_done = (count > 1) ? &instances[i ^ 1].done : NULL;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        started[i] = !pthread_create(&threads[i], NULL, pacing_thread, &instances[i]);
+        if (!started[i])
+        {
+            fprintf(stderr, "%s: cannot start thread\n", instances[i].name);
+            __atomic_store_n(&instances[i].done, 1, __ATOMIC_RELEASE);
+            failures++;
+        }
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        if (!started[i])
+        {
+            continue;
+        }
+
+        pthread_join(threads[i], NULL);
+        if (instances[i].ret != WS2811_SUCCESS)
+        {
+            fprintf(stderr, "%s: ws2811_render failed: %s\n", instances[i].name,
+                    ws2811_get_return_t_str(instances[i].ret));
+            failures++;
+        }
+    }
+
+    return failures ? -1 : 0;
+}
+
+/**
+ * Drive a PWM and a PCM capture instance in real time, with frame times far
+ * apart.  Each one first runs alone, and must send its frames as fast as its own
+ * frame time and reset gap allow.  Then both run at once from two threads, and
+ * neither may be slowed down by the other by more than PACING_DRIFT_US a frame.
+ * The median time between frames is compared, so a thread woken up late now and
+ * then doesn't fail the test, while an instance waiting for the other one does.
+ *
+ * @returns  0 if both kept their own pace, -1 otherwise.
+ */
+static int pacing_test(void)
+{
+    pacing_instance_t instances[2] =
+    {
+        { .name = "pwm", .frames = 96 },
+        { .name = "pcm", .frames = 24 },
+    };
+    uint64_t alone_us[2];
+    int failures = 0;
+    int i;
+
+    // PWM on DMA 10 with short strips, PCM on DMA 5 with a long one
+    instances[0].ws2811.dmanum = 10;
+    instances[0].ws2811.channel[0].gpionum = 18;
+    instances[0].ws2811.channel[0].count = 100;
+    instances[0].ws2811.channel[1].gpionum = 13;
+    instances[0].ws2811.channel[1].count = 50;
+    instances[1].ws2811.dmanum = 5;
+    instances[1].ws2811.channel[0].gpionum = 21;
+    instances[1].ws2811.channel[0].count = 500;
+
+    for (i = 0; i < 2; i++)
+    {
+        ws2811_t *ws2811 = &instances[i].ws2811;
+        ws2811_return_t ret;
+        int chan;
+
+        ws2811->freq = freq;
+        ws2811->capture.enabled = 1;
+        ws2811->capture.realtime = 1;
+        for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+        {
+            ws2811->channel[chan].strip_type = strip_type;
+            ws2811->channel[chan].brightness = 255;
+        }
+
+        if ((ret = ws2811_init(ws2811)) != WS2811_SUCCESS)
+        {
+            fprintf(stderr, "%s: ws2811_init failed: %s\n", instances[i].name, ws2811_get_return_t_str(ret));
+            while (i--)
+            {
+                ws2811_fini(&instances[i].ws2811);
+            }
+            return -1;
+        }
+    }
+
+    for (i = 0; (i < 2) && !failures; i++)
+    {
+        pacing_instance_t *instance = &instances[i];
+        ws2811_t *ws2811 = &instance->ws2811;
+        uint64_t wire_us, expected_us;
+        int ok;
+
+        if (pacing_run(instance, 1))
+        {
+            failures++;
+            break;
+        }
+        alone_us[i] = instance->spacing_us;
+
+        // A frame takes its frame time plus the reset gap, or as long as the wire
+        // stream lasts if that is longer.  PWM sends both channels at once.
+        wire_us = ((uint64_t)ws2811->capture.frame_bytes * 8 * 1000000) / (ws2811->freq * 3);
+        if (i == 0)
+        {
+            wire_us /= RPI_PWM_CHANNELS;
+        }
+        expected_us = ws2811->render_wait_time > wire_us ? ws2811->render_wait_time : wire_us;
+
+        ok = (alone_us[i] >= expected_us) && (alone_us[i] <= expected_us + PACING_TOLERANCE_US);
+        if (!ok)
+        {
+            failures++;
+        }
+
+        printf("%s alone: %d frames every %llu us, expected %llu us, %s\n", instance->name,
+               instance->frames, (unsigned long long)alone_us[i], (unsigned long long)expected_us,
+               ok ? "ok" : "FAILED");
+    }
+
+    if (!failures && pacing_run(instances, 2))
+    {
+        failures++;
+    }
+
+    for (i = 0; (i < 2) && !failures; i++)
+    {
+        pacing_instance_t *instance = &instances[i];
+        const int ok = instance->spacing_us <= alone_us[i] + PACING_DRIFT_US;
+
+        if (!ok)
+        {
+            failures++;
+        }
+
+        printf("%s with %s: %d frames every %llu us, %s\n", instance->name, instances[i ^ 1].name,
+               instance->frames, (unsigned long long)instance->spacing_us, ok ? "ok" : "FAILED");
+    }
+
+    for (i = 0; i < 2; i++)
+    {
+        ws2811_fini(&instances[i].ws2811);
+    }
+
+    return failures ? -1 : 0;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+        "Usage: %s [options] file...\n"
+        "Decodes capture files or raw wire streams back into LED values\n"
+        "and checks the reset time after them.\n\n"
+        "Options:\n"
+        "-h (--help)     - this information\n"
+        "-l (--layout)   - layout of raw files - pwm, pcm, spi (default pwm)\n"
+        "-f (--freq)     - output frequency of raw files (default %d)\n"
+        "-s (--strip)    - strip type - rgb, grb, gbr, rgbw, ... (default grb)\n"
+        "-i (--invert)   - PCM and SPI output was inverted in software\n"
+        "-v (--verbose)  - print the frame headers and every LED\n"
+        "-t (--test)     - check the encoders and kernels against the decoder, and every\n"
+        "                  render path through the capture backend\n"
+        "-p (--pacing)   - check that two instances in separate threads keep their own frame rate\n",
+        name, WS2811_TARGET_FREQ);
+}
+
+static void parseargs(int argc, char **argv)
+{
+    static struct option longopts[] =
+    {
+        {"help", no_argument, 0, 'h'},
+        {"layout", required_argument, 0, 'l'},
+        {"freq", required_argument, 0, 'f'},
+        {"strip", required_argument, 0, 's'},
+        {"invert", no_argument, 0, 'i'},
+        {"verbose", no_argument, 0, 'v'},
+        {"test", no_argument, 0, 't'},
+        {"pacing", no_argument, 0, 'p'},
+        {0, 0, 0, 0}
+    };
+    unsigned int i;
+    int c;
+
+    while ((c = getopt_long(argc, argv, "f:hil:ps:tv", longopts, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case 'l':
+            for (layout = WS2811_LAYOUT_PWM; layout <= WS2811_LAYOUT_SPI; layout++)
+            {
+                if (!strcasecmp(layout_names[layout], optarg))
+                {
+                    break;
+                }
+            }
+            if (layout > WS2811_LAYOUT_SPI)
+            {
+                fprintf(stderr, "invalid layout %s\n", optarg);
+                exit(-1);
+            }
+            break;
+
+        case 'f':
+            freq = atoi(optarg);
+            if (!freq)
+            {
+                fprintf(stderr, "invalid frequency %s\n", optarg);
+                exit(-1);
+            }
+            break;
+
+        case 's':
+            for (i = 0; i < sizeof(strip_names) / sizeof(strip_names[0]); i++)
+            {
+                if (!strcasecmp(strip_names[i].name, optarg))
+                {
+                    strip_type = strip_names[i].strip_type;
+                    break;
+                }
+            }
+            if (i == sizeof(strip_names) / sizeof(strip_names[0]))
+            {
+                fprintf(stderr, "invalid strip %s\n", optarg);
+                exit(-1);
+            }
+            break;
+
+        case 'i':
+            invert = 1;
+            break;
+
+        case 'v':
+            verbose = 1;
+            break;
+
+        case 't':
+            selftest = 1;
+            break;
+
+        case 'p':
+            pacing = 1;
+            break;
+
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+
+        default:
+            usage(argv[0]);
+            exit(-1);
+        }
+    }
+
+    if (!selftest && !pacing && (optind >= argc))
+    {
+        usage(argv[0]);
+        exit(-1);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int ret = 0;
+    int i;
+
+    parseargs(argc, argv);
+
+    if (selftest && self_test())
+    {
+        ret = 1;
+    }
+
+    if (selftest && render_test())
+    {
+        ret = 1;
+    }
+
+    if (pacing && pacing_test())
+    {
+        ret = 1;
+    }
+
+    for (i = optind; i < argc; i++)
+    {
+        if (decode_file(argv[i]))
+        {
+            ret = 1;
+        }
+    }
+
+    return ret;
+}